@@ -34,6 +34,17 @@
 #include <time.h>
 #include <signal.h>
 #include <termios.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+#include <glib-unix.h>
 
 #include <gattlib.h>
 
@@ -50,10 +61,66 @@ uuid_t g_command_uuid = CREATE_UUID16(0xfff1);
 uuid_t g_control_uuid = CREATE_UUID16(0xfff3);
 const uuid_t g_measurement_uuid = CREATE_UUID16(0xfff4);
 
-gatt_connection_t* connection;
-char *address = NULL;
 const char BDM[] = "BDM";
 
+// Bluetooth adapters
+#define MAX_ADAPTERS    8
+
+struct adapter {
+    const char *name;               // NULL for the default adapter
+    int meters;                     // Meters assigned to this adapter
+    unsigned long connects;
+    unsigned long failures;
+    unsigned long packets;
+};
+
+struct adapter adapters[MAX_ADAPTERS];
+int num_adapters = 0;
+
+void* adapter_handle = NULL;
+
+// Multimeters
+#define MAX_METERS      16
+
+struct meter {
+    char address[18];
+    struct adapter *adapter;
+    gatt_connection_t* connection;
+    _Bool active;                   // Watchdog flag
+    int low_battery;
+    unsigned long packets;
+    gint64 arrival;                 // Time the last notification was received
+    struct history *history;
+
+    // Hot-plug state
+    _Bool pinned;                   // Always use the same adapter
+    _Bool pending;                  // Connection requested
+    gint64 attached_at;
+    gint64 hold_until;              // Don't reattach before this time
+    int hold;                       // Seconds to wait before reattaching after a drop out
+
+    // Reconnection
+    guint reconnect_source;
+    int retry;                      // Seconds until the next attempt
+    _Bool connecting;               // Asynchronous connection attempt in progress
+    unsigned int attempt;           // Current attempt, so results of abandoned ones are ignored
+    gint64 connect_started;
+    void (*connected)(struct meter *meter);     // Called once the attempt has succeeded or failed
+
+    // Offline recording download
+    _Bool downloading;
+    uint16_t offline_function;
+    time_t offline_time;
+    uint32_t offline_interval;
+};
+
+struct meter meters[MAX_METERS];
+int num_meters = 0;
+int wanted_meters = 1;              // Number of meters to find when scanning
+
+char **allowed = NULL;              // Addresses allowed when scanning, any meter if empty
+int num_allowed = 0;
+
 // Offline recording
 #define DATE_CMD    "*DATe"
 #define RECORD_CMD  "*RECOrd,"
@@ -66,9 +133,6 @@ uint32_t interval = 0;
 uint32_t num_measurements = 0;
 
 _Bool offline = FALSE;
-uint16_t offline_function = 0;
-time_t offline_time = 0;
-uint32_t offline_interval;
 
 
 // Interactive controls
@@ -86,70 +150,113 @@ struct termios orig_termios;
 #define NORMAL          0x0006
 #define MIN_MAX         0x0106
 
+// Control names for socket commands and alarm rules
+const struct {
+    const char *name;
+    uint16_t control;
+} control_names[] = {
+    {"select", SELECT}, {"auto", AUTO}, {"range", RANGE}, {"light", LIGHT}, {"hold", HOLD},
+    {"bluetooth_off", BLUETOOTH_OFF}, {"relative", RELATIVE}, {"delta", RELATIVE}, {"hz", HZ},
+    {"normal", NORMAL}, {"min_max", MIN_MAX}, {"minmax", MIN_MAX}
+};
 
-// Output options
-enum {space, csv, json} format = space;
 
-enum {none, elapsed_sec, actual_sec, elapsed_milli, actual_milli, date} timestamp = none;
-int units = 0;
+// One-shot sampling
+#define EXIT_NOT_FOUND      2
+#define EXIT_CONNECT_FAILED 3
+#define EXIT_TIMEOUT        4
 
-_Bool show_units = TRUE;
+#define CONNECT_RETRIES     3       // Connection attempts when sampling without a deadline
+#define RECONNECT_MIN       1       // Seconds before retrying a lost connection
+#define RECONNECT_MAX       60      // Longest time between reconnection attempts
+#define CONNECT_TIMEOUT     30      // Seconds before abandoning an asynchronous connection attempt
 
-int low_battery = FALSE;
+unsigned long sample_count = 0;     // Exit after this many realtime measurements
+unsigned long samples = 0;
+unsigned int deadline = 0;          // Overall time limit in seconds
 
-unsigned long start_time = 0;
+// Startup timing
+_Bool timing = FALSE;
+gint64 start_timing, scan_timing, connect_timing, listen_timing, sample_timing;
 
-// Watchdog flag
-_Bool active = FALSE;
+// Output options
+enum output_format {space, csv, json};
+
+enum output_timestamp {none, elapsed_sec, actual_sec, elapsed_milli, actual_milli, date};
+
+struct output_options {
+    enum output_format format;
+    enum output_timestamp timestamp;
+    int units;
+    _Bool show_units;
+    _Bool show_device;          // Identify the meter when more than one is connected
+    unsigned long start_time;
+    time_t hour_start;          // Local time of the current hour for date timestamps
+    struct tm hour;
+};
+
+struct output_options output = {space, none, 0, TRUE, FALSE, 0};
+
+// Decoded measurement
+struct sample {
+    char device[18];
+    int function;
+    int scale;
+    int decimal;
+    float measurement;
+    uint16_t type;
+    struct timeval time;
+};
 
 // Outputs the measurement timestamp
-void print_timestamp() {
+void format_timestamp(GString *line, struct output_options *options, const struct timeval *now) {
 
-    struct timeval now;
     char date_now[30];
+    unsigned long now_milli = now->tv_sec*1000 + now->tv_usec/1000;
 
-    if (timestamp == none) return;
-
-    if (offline_time) {
-        now.tv_sec = offline_time;
-        now.tv_usec = 0;
-    } else {
-        gettimeofday(&now,NULL);
-    }
-
-    switch (timestamp) {
+    switch (options->timestamp) {
         case none:
             break;
 
         case elapsed_sec:
-            if (start_time == 0) {
-                printf("0.0");
-                start_time = now.tv_sec*1000 + now.tv_usec/1000;
+            if (options->start_time == 0) {
+                g_string_append(line, "0.0");
+                options->start_time = now_milli;
             } else {
-                printf("%.1f", (float)((now.tv_sec*1000 + now.tv_usec/1000) - start_time)/1000);
+                g_string_append_printf(line, "%.1f", (float)(now_milli - options->start_time)/1000);
             }
             break;
 
         case actual_sec:
-            printf("%ld.%ld", now.tv_sec, now.tv_usec/100000);
+            g_string_append_printf(line, "%ld.%ld", now->tv_sec, now->tv_usec/100000);
             break;
 
         case elapsed_milli:
-            if (start_time == 0) {
-                printf("0");
-                start_time = now.tv_sec*1000 + now.tv_usec/1000;
+            if (options->start_time == 0) {
+                g_string_append(line, "0");
+                options->start_time = now_milli;
             } else {
-                printf("%ld", ((now.tv_sec*1000 + now.tv_usec/1000) - start_time));
+                g_string_append_printf(line, "%ld", (now_milli - options->start_time));
             }
             break;
 
         case actual_milli:
-            printf("%ld", now.tv_sec*1000 + now.tv_usec/1000);
+            g_string_append_printf(line, "%ld", now_milli);
             break;
 
         case date:
-            strftime(date_now,30, "%F %H:%M:%S", localtime(&now.tv_sec));
-            printf("%s.%ld", date_now, now.tv_usec/100000);
+            // Only convert to local time once an hour
+            if ((options->hour_start == 0) || (now->tv_sec < options->hour_start) ||
+                    (now->tv_sec >= options->hour_start + 3600)) {
+                localtime_r(&now->tv_sec, &options->hour);
+                options->hour_start = now->tv_sec - options->hour.tm_min * 60 - options->hour.tm_sec;
+            }
+
+            options->hour.tm_min = (now->tv_sec - options->hour_start) / 60;
+            options->hour.tm_sec = (now->tv_sec - options->hour_start) % 60;
+
+            strftime(date_now,30, "%F %H:%M:%S", &options->hour);
+            g_string_append_printf(line, "%s.%ld", date_now, now->tv_usec/100000);
             break;
 
     }
@@ -158,563 +265,4084 @@ void print_timestamp() {
 
 
 // Outputs the measurement value
-void print_measurement(float measurement, int decimal, int scale) {
+void format_measurement(GString *line, struct output_options *options, float measurement, int decimal,
+        int scale) {
 
     if (decimal > 3) {
-        printf("Overload");
+        g_string_append(line, "Overload");
     } else {
 
-        if (units && (units != scale)) {
+        if (options->units && (options->units != scale)) {
 
-            measurement = measurement * pow(10.0, (scale-units)*3);
+            measurement = measurement * pow(10.0, (scale-options->units)*3);
 
-            decimal = decimal - (scale-units)*3;
+            decimal = decimal - (scale-options->units)*3;
 
         }
 
-        printf("% .*f", decimal, measurement);
+        g_string_append_printf(line, "% .*f", decimal, measurement);
 
     }
 
 }
 
+// Measurement unit names
+const char *scale_prefix[] = {"", "n", "u", "m", "", "k", "M", ""};
+
+const char *function_units[] = {"Vdc", "Vac", "Adc", "Aac", "Ohms", "F", "Hz", "%",
+    "°C", "°F", "V", "Ohms", "hFE", "", "", ""};
+
 // Outputs the measurement units
-void print_units(int scale, int function) {
+void format_units(GString *line, struct output_options *options, int scale, int function) {
 
-    if (units) scale = units;
+    if (options->units) scale = options->units;
 
-    switch (scale) {
-        case 1:
-            printf("n");
-            break;
+    g_string_append(line, scale_prefix[scale & 0x07]);
+    g_string_append(line, function_units[function & 0x0f]);
 
-        case 2:
-            printf("u");
-            break;
+}
 
-        case 3:
-            printf("m");
-            break;
+// Outputs the measurement type
+void format_type(GString *line, uint16_t type) {
+
+    if (type & 0x02) g_string_append(line, "Δ ");
+    if (type & 0x10) g_string_append(line, "min");
+    if (type & 0x20) g_string_append(line, "max");
+    if (type & 0x01) g_string_append(line, "hold");
+
+    // Summaries from the measurement history
+    if (type & 0x100) g_string_append(line, "low");
+    if (type & 0x200) g_string_append(line, "high");
+    if (type & 0x400) g_string_append(line, "mean");
+
+}
+
+// Formats a measurement as a line of output
+void format_reading(GString *line, struct output_options *options, struct sample *sample) {
+
+    char separator = (options->format == csv) ? ',' : ' ';
+
+    switch (options->format) {
+        case space:
+        case csv:
+
+            if (options->show_device && sample->device[0]) {
+                g_string_append(line, sample->device);
+                g_string_append_c(line, separator);
+            }
+
+            if (options->timestamp) {
+                format_timestamp(line, options, &sample->time);
+                g_string_append_c(line, separator);
+            }
+
+            format_measurement(line, options, sample->measurement, sample->decimal, sample->scale);
+
+            if (options->show_units) {
+                g_string_append_c(line, separator);
+                format_units(line, options, sample->scale, sample->function);
+                g_string_append_c(line, separator);
+                format_type(line, sample->type);
+            }
+            g_string_append_c(line, '\n');
 
-        case 5:
-            printf("k");
             break;
 
-        case 6:
-            printf("M");
+        case json:
+
+            g_string_append(line, "{");
+
+            if (options->show_device && sample->device[0]) {
+                g_string_append_printf(line, "\"device\":\"%s\", ", sample->device);
+            }
+
+            if (options->timestamp) {
+                g_string_append(line, "\"timestamp\":");
+                if (options->timestamp == date) g_string_append(line, "\"");
+                format_timestamp(line, options, &sample->time);
+                if (options->timestamp == date) g_string_append(line, "\"");
+                g_string_append(line, ", ");
+            }
+
+            g_string_append(line, "\"measurement\":");
+            format_measurement(line, options, sample->measurement, sample->decimal, sample->scale);
+
+            if (options->show_units) {
+                g_string_append(line, ", \"units\":\"");
+                format_units(line, options, sample->scale, sample->function);
+                g_string_append(line, "\", \"type\":\"");
+                format_type(line, sample->type);
+                g_string_append(line, "\"");
+            }
+            g_string_append(line, " }\n");
+
             break;
+
     }
 
-    switch (function) {
+}
+
+// Sets an output option from its command line letter
+_Bool set_output_option(struct output_options *options, char option) {
 
-        case 0:
-            printf("Vdc");
+    switch (option) {
+        case 's':
+            options->timestamp = elapsed_sec;
+            break;
+
+        case 'S':
+            options->timestamp = actual_sec;
             break;
 
-        case 1:
-            printf("Vac");
+        case 't':
+            options->timestamp = elapsed_milli;
             break;
 
-        case 2:
-            printf("Adc");
+        case 'T':
+            options->timestamp = actual_milli;
             break;
 
-        case 3:
-            printf("Aac");
+        case 'd':
+            options->timestamp = date;
             break;
 
-        case 4:
-            printf("Ohms");
+        case 'c':
+            options->format = csv;
             break;
 
-        case 5:
-            printf("F");
+        case 'j':
+            options->format = json;
             break;
 
-        case 6:
-            printf("Hz");
+        case 'n':
+            options->units = 1;
             break;
 
-        case 7:
-            printf("%%");
+        case 'u':
+            options->units = 2;
             break;
 
-        case 8:
-            printf("°C");
+        case 'm':
+            options->units = 3;
             break;
 
-        case 9:
-            printf("°F");
+        case 'b':
+            options->units = 4;
             break;
 
-        case 10:
-            printf("V");
+        case 'k':
+            options->units = 5;
             break;
 
-        case 11:
-            printf("Ohms");
+        case 'M':
+            options->units = 6;
             break;
 
-        case 12:
-            printf("hFE");
+        case 'x':
+            options->show_units = FALSE;
             break;
 
+        default:
+            return FALSE;
     }
 
+    return TRUE;
 }
 
-// Outputs the measurement type
-void print_type(uint16_t type) {
+// Dashboard display
+_Bool dashboard = FALSE;
+_Bool dashboard_stdout = FALSE;     // Dashboard is drawn on stdout so readings are not printed
+int dashboard_fd = -1;
 
-    if (type & 0x02) printf("Δ ");
-    if (type & 0x10) printf("min");
-    if (type & 0x20) printf("max");
-    if (type & 0x01) printf("hold");
+#define DASHBOARD_REFRESH   250     // Minimum milliseconds between redraws
+#define DASHBOARD_HISTORY   256     // Sparkline samples kept per meter
+#define DASHBOARD_LINES     64
 
-}
+enum link_state {link_connecting, link_connected, link_timeout, link_detached};
+const char *link_names[] = {"Connecting", "Connected", "Timeout - reconnecting", "Detached"};
 
-// Outputs the measurement
-void display_reading(uint16_t* reading) {
+const char *function_names[] = {"DC Voltage", "AC Voltage", "DC Current", "AC Current",
+    "Resistance", "Capacitance", "Frequency", "Duty Cycle", "Temperature", "Temperature",
+    "Diode", "Continuity", "hFE", "", "", ""};
 
-    int function, scale, decimal;
+const char *sparkline_blocks[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
 
+struct panel {
+    char device[18];
+    enum link_state link;
+    _Bool valid;
     float measurement;
+    int function, scale, decimal;
+    uint16_t type;
+    float history[DASHBOARD_HISTORY];
+    int history_head, history_count;
+};
 
-    // Extract data items from first number
-    function = (reading[0] >> 6) & 0x0f;
-    scale = (reading[0] >> 3) & 0x07;
-    decimal = reading[0] & 0x07;
+struct panel panels[MAX_METERS];
+int num_panels = 0;
 
-    // Extract and convert measurement value
-    if (reading[2] < 0x7fff) {
-        measurement = (float)reading[2] / pow(10.0, decimal);
-    } else {
-        measurement = -1 * (float)(reading[2] & 0x7fff) / pow(10.0, decimal);
-    }
+char dashboard_status[128] = "";
 
+// Last drawn contents of each screen line for damage tracking
+char *screen[DASHBOARD_LINES];
+int screen_rows = 24, screen_cols = 80;
+int screen_used = 0;
 
-    // Check for low battery condition
-    if (reading[1] & 0x08) {
-        if (!low_battery) {
-            fprintf(stderr, "LOW BATTERY\n");
-        }
+guint redraw_source = 0;
 
-        if (low_battery++ > 17) low_battery = 0;
+// Find or allocate the dashboard panel for a meter
+struct panel *dashboard_panel(const char *device) {
 
-    } else {
-        low_battery = FALSE;
+    for (int i = 0; i < num_panels; i++) {
+        if (strcmp(panels[i].device, device) == 0) return &panels[i];
     }
 
+    if (num_panels == MAX_METERS) return NULL;
 
-    switch (format) {
-        case space:
-        case csv:
+    memset(&panels[num_panels], 0, sizeof(struct panel));
+    strncpy(panels[num_panels].device, device, sizeof(panels[num_panels].device) - 1);
 
-            if (timestamp) {
-                print_timestamp();
-                printf("%c", (format?',':' '));
-            }
+    return &panels[num_panels++];
+}
 
-            print_measurement(measurement, decimal, scale);
+// Copy a line, dropping characters past the screen width.  Escape sequences are kept so
+// attributes are still reset, and UTF-8 sequences count as one character.
+gchar *dashboard_clip(const char *text) {
+
+    gchar *clipped = g_malloc(strlen(text) + 1);
+    char *out = clipped;
+    int width = 0;
+
+    while (*text) {
+        if (*text == '\033') {
+            // Copy up to and including the final byte of the escape sequence
+            *out++ = *text++;
+            if (*text == '[') *out++ = *text++;
+            while (*text && ((*text < 0x40) || (*text > 0x7e))) *out++ = *text++;
+            if (*text) *out++ = *text++;
+            continue;
+        }
 
-            if (show_units) {
-                printf("%c", (format?',':' '));
-                print_units(scale, function);
-                printf("%c", (format?',':' '));
-                print_type(reading[1]);
-            }
-            printf("\n");
+        // Leave the last column empty so the terminal never wraps
+        if (((*text & 0xc0) != 0x80) && (width++ >= screen_cols - 1)) {
+            do text++; while ((*text & 0xc0) == 0x80);
+            continue;
+        }
 
-            break;
+        *out++ = *text++;
+    }
 
-        case json:
+    *out = '\0';
 
-            printf("{");
+    return clipped;
+}
 
-            if (timestamp) {
-                printf("\"timestamp\":");
-                if (timestamp == date) printf("\"");
-                print_timestamp();
-                if (timestamp == date) printf("\"");
-                printf(", ");
-            }
+// Queue a line for output if it differs from what is already on screen
+void dashboard_line(GString *frame, int row, const char *text) {
 
-            printf("\"measurement\":");
-            print_measurement(measurement, decimal, scale);
+    gchar *clipped;
 
-            if (show_units) {
-                printf(", \"units\":\"");
-                print_units(scale, function);
-                printf("\", \"type\":\"");
-                print_type(reading[1]);
-                printf("\"");
-            }
-            printf(" }\n");
+    if ((row >= screen_rows) || (row >= DASHBOARD_LINES)) return;
 
-            break;
+    // Compare what will actually be shown, otherwise a line that wrapped is never repainted
+    clipped = dashboard_clip(text);
 
+    if (screen[row] && (strcmp(screen[row], clipped) == 0)) {
+        g_free(clipped);
+        return;
     }
 
-    // Flush output for realtime displays
-    fflush(stdout);
+    g_free(screen[row]);
+    screen[row] = clipped;
+
+    g_string_append_printf(frame, "\033[%d;1H%s\033[K", row + 1, clipped);
 }
 
+// Render the recent measurement history as a sparkline
+void dashboard_sparkline(struct panel *panel, char *line, int width) {
 
-// Handler for BLE notification events
-void notification_handler(const uuid_t* uuid, const uint8_t* data, size_t data_length, void* user_data) {
+    float min = INFINITY, max = -INFINITY;
+    int count = MIN(panel->history_count, width);
+    int first = panel->history_head - count + DASHBOARD_HISTORY;
 
-    uint16_t reading[3];
-    int index;
+    for (int i = 0; i < count; i++) {
+        float value = panel->history[(first + i) % DASHBOARD_HISTORY];
+        if (isnan(value)) continue;
+        if (value < min) min = value;
+        if (value > max) max = value;
+    }
 
-    // Reset watchdog flag
-    active = TRUE;
+    line = stpcpy(line, "  ");
 
-    if (offline) {
-        // Process offline recording dump packet
+    for (int i = 0; i < count; i++) {
+        float value = panel->history[(first + i) % DASHBOARD_HISTORY];
+        int level = 3;
 
-        if (!offline_function && (data_length < 20)) return;
+        if (isnan(value)) {
+            line = stpcpy(line, " ");
+            continue;
+        }
 
-        if (!offline_function && (data[0] == 0xff)) return;  // skip lead-in
+        if (max > min) level = (int)((value - min) / (max - min) * 7.0 + 0.5);
 
-        index = 0;
+        line = stpcpy(line, sparkline_blocks[level]);
+    }
+}
 
-        if (!offline_function) {
-            // Read header
+// Redraw the changed parts of the dashboard
+void dashboard_redraw() {
 
-            // Extract recording start timestamp
-            struct tm brokentime;
+    GString *frame;
+    char line[DASHBOARD_HISTORY * 3 + 16];
+    int row = 0;
+    int available, panel_rows = 4, shown = num_panels;
 
-            brokentime.tm_year = data[0] * 100 + data[1];
-            brokentime.tm_mon = data[2] - 1;
-            brokentime.tm_mday = data[3];
-            brokentime.tm_hour = data[4];
-            brokentime.tm_min = data[5];
-            brokentime.tm_sec = data[6];
+    if (dashboard_fd < 0) return;
 
-            offline_time = mktime(&brokentime);
+    frame = g_string_new(NULL);
 
-            // Extract measurement interval
-            offline_interval = *((uint32_t *)(data+8));
+    snprintf(line, sizeof(line), "\033[1m owonb35 %s\033[0m  %s", VERSION, dashboard_status);
+    dashboard_line(frame, row++, line);
 
-            // Extract measurement function and units
-            offline_function = *((uint16_t *)(data+16));
+    // Panels are 4 rows with a sparkline, squeezed to 2 rows then 1 row when the terminal is
+    // too short, leaving room for the status line, a blank line and the key legend
+    available = MIN(screen_rows, DASHBOARD_LINES) - 3;
+    if (num_panels * 4 > available) panel_rows = 2;
+    if (num_panels * 2 > available) panel_rows = 1;
+    if (num_panels > available) shown = MAX(available - 1, 0);
 
-            index = 18;
+    for (int i = 0; i < shown; i++) {
+        struct panel *panel = &panels[i];
+        char value[32];
+        char modes[32];
 
+        if (!panel->valid) {
+            strcpy(value, "No reading");
+        } else if (panel->decimal > 3) {
+            strcpy(value, "Overload");
+        } else {
+            snprintf(value, sizeof(value), "% .*f", panel->decimal, panel->measurement);
         }
 
-        reading[0] = offline_function;
-        reading[1] = 0;
-
-        for(;index < 20; index+=2) {
-
-            if (*((uint16_t *)(data+index)) == 0xffff) {
-                g_main_loop_quit(loop);
-                return;
-            }
+        snprintf(modes, sizeof(modes), "%s%s%s%s",
+            (panel->type & 0x01) ? " HOLD" : "",
+            (panel->type & 0x02) ? " DELTA" : "",
+            (panel->type & 0x10) ? " MIN" : "",
+            (panel->type & 0x20) ? " MAX" : "");
+
+        if (panel_rows == 1) {
+            snprintf(line, sizeof(line), " %.17s \033[1m%10s %s%-4s\033[0m %s%s%s",
+                panel->device, value,
+                panel->valid ? scale_prefix[panel->scale & 0x07] : "",
+                panel->valid ? function_units[panel->function & 0x0f] : "",
+                (panel->link == link_connected) ? "" : link_names[panel->link],
+                panel->valid ? modes : "",
+                (panel->valid && (panel->type & 0x08)) ? "  \033[7m LOW BATTERY \033[0m" : "");
+            dashboard_line(frame, row++, line);
+            continue;
+        }
 
-            reading[2] = *((uint16_t *)(data+index));
+        if (panel_rows == 4) dashboard_line(frame, row++, "");
 
-            display_reading(reading);
+        snprintf(line, sizeof(line), " %.17s  %s%s", panel->device, link_names[panel->link],
+            (panel->valid && (panel->type & 0x08)) ? "  \033[7m LOW BATTERY \033[0m" : "");
+        dashboard_line(frame, row++, line);
 
-            offline_time += offline_interval;
+        if (!panel->valid) {
+            dashboard_line(frame, row++, "   No reading");
+            if (panel_rows == 4) dashboard_line(frame, row++, "");
+            continue;
         }
 
-    } else if ((data_length == 6) && (data[1] >= 0xf0)) {
+        snprintf(line, sizeof(line), "  \033[1m%10s %s%-4s\033[0m  %-12s %s range%s",
+            value, scale_prefix[panel->scale & 0x07], function_units[panel->function & 0x0f],
+            function_names[panel->function & 0x0f], (panel->type & 0x04) ? "Auto" : "Manual", modes);
+        dashboard_line(frame, row++, line);
 
-        // Realtime measurement packet
+        if (panel_rows == 4) {
+            dashboard_sparkline(panel, line, MIN(screen_cols - 3, DASHBOARD_HISTORY));
+            dashboard_line(frame, row++, line);
+        }
+    }
 
-        display_reading((uint16_t*)data);
+    if (shown < num_panels) {
+        snprintf(line, sizeof(line), " +%d more meters - enlarge the terminal to show them",
+            num_panels - shown);
+        dashboard_line(frame, row++, line);
+    }
 
-    } else {
+    dashboard_line(frame, row++, "");
+    dashboard_line(frame, row++, " s Select  a Auto  r Range  l Light  h Hold  d Delta  f Hz/Duty"
+        "  m Min/Max  n Normal  b BT off  q Quit");
 
-        fprintf(stderr, "Unrecognized packet: ");
+    // Blank any lines left over from a larger previous frame
+    for (int i = row; i < screen_used; i++) dashboard_line(frame, i, "");
+    screen_used = row;
 
-        for (int i = 0; i < data_length; i++) {
-            fprintf(stderr, "%02x ", data[i]);
+    if (frame->len) {
+        if (write(dashboard_fd, frame->str, frame->len) < 0) {
+            // Nothing useful can be done if the terminal has gone
         }
+    }
 
-        fprintf(stderr, "\n");
+    g_string_free(frame, TRUE);
+}
 
-    }
+gboolean dashboard_redraw_timeout(gpointer data) {
 
+    redraw_source = 0;
+    dashboard_redraw();
 
+    return FALSE;
 }
 
-static void usage(char *argv[]) {
-    printf("%s [-s|-S|-t|-T|-d] [-c|-j] [-n|-u|-m|-b|-k|-M] [-x] [-r] [-q] [-h|-V] [<device_address>]\n", argv[0]);
-    printf("\tMeasurement collection\n\n");
-    printf("%s -R <seconds per measurement> <number of measurements> [<device_address>]\n", argv[0]);
-    printf("\tStart offline measurement recording\n\n");
-    printf("\tClient for Owon B35/B35+/B35T+ digital multimeters using bluetooth.\n\n");
-    printf("\t-i\t\t Interactive remote control\n");
-    printf("\t-s\t\t Timestamp measurements in elapsed seconds from first reading\n");
-    printf("\t-S\t\t Timestamp measurements in Unix epoch seconds\n");
-    printf("\t-t\t\t Timestamp measurements in elapsed milliseconds from first reading\n");
-    printf("\t-T\t\t Timestamp measurements in Javascript epoch milliseconds\n");
-    printf("\t-d\t\t Timestamp measurements with ISO date/time\n");
-    printf("\t-c\t\t Comma separated values (CSV) output\n");
-    printf("\t-j\t\t JSON output\n");
-    printf("\t-n\t\t Scale measurements to nano units\n");
-    printf("\t-u\t\t Scale measurements to micro units\n");
-    printf("\t-m\t\t Scale measurements to milli units\n");
-    printf("\t-b\t\t Scale measurements to base units\n");
-    printf("\t-k\t\t Scale measurements to kilo units\n");
-    printf("\t-M\t\t Scale measurements to mega units\n");
-    printf("\t-x\t\t Output measurement value without units or type for use with feedgnuplot\n");
-    printf("\t-R\t\t Start offline measurement recording\n");
-    printf("\t-r\t\t Download offline measurement recording\n");
-    printf("\t-q\t\t Quiet - no status output\n");
-    printf("\t-h\t\t Display this help and exit\n");
-    printf("\t-V\t\t Display version and exit\n");
-    printf("\t<device_address> Address of Owon multimeter to connect\n");
-    printf("\t\t\t  otherwise will connect to first meter found if not specified\n");
-    printf("\n\tInteractive controls:\n");
-    printf("\t\ts - Select\n");
-    printf("\t\ta - Auto\n");
-    printf("\t\tr - Range\n");
-    printf("\t\tl - Backlight\n");
-    printf("\t\th - Hold\n");
-    printf("\t\tb - Turn off Bluetooth\n");
-    printf("\t\td - Delta (Relative)\n");
-    printf("\t\tf - Fequency Hz/Duty\n");
-    printf("\t\tm - Min/Max\n");
-    printf("\t\tn - Normal display\n");
+// Schedule a redraw, coalescing changes that arrive within the refresh interval
+void dashboard_invalidate() {
 
+    if (!redraw_source) redraw_source = g_timeout_add(DASHBOARD_REFRESH, dashboard_redraw_timeout, NULL);
 }
 
-// Event handler for interactive controls
-static gboolean interactive_read(GIOChannel *chan, GIOCondition cond,
-							gpointer user_data) {
+// Redraw after a change - immediately while starting up, as the main loop isn't running yet
+// to draw scheduled redraws
+void dashboard_refresh() {
 
-    gchar buffer;
-    gsize chars_read;
+    if (loop && g_main_loop_is_running(loop)) {
+        dashboard_invalidate();
+    } else {
+        dashboard_redraw();
+    }
+}
 
-    uint16_t control;
+// Discard the screen contents and redraw everything at the new terminal size
+void dashboard_resize() {
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-		g_io_channel_unref(chan);
-		return FALSE;
-	}
+    struct winsize size;
 
-	g_io_channel_read_chars(chan, &buffer, 1, &chars_read, NULL);
+    if ((ioctl(dashboard_fd, TIOCGWINSZ, &size) == 0) && size.ws_row && size.ws_col) {
+        screen_rows = size.ws_row;
+        screen_cols = size.ws_col;
+    }
 
-    switch (buffer) {
-        case 's':
-            control = SELECT;
-            break;
+    for (int i = 0; i < DASHBOARD_LINES; i++) {
+        g_free(screen[i]);
+        screen[i] = NULL;
+    }
 
-        case 'a':
-            control = AUTO;
-            break;
+    if (write(dashboard_fd, "\033[2J", 4) < 0) return;
 
-        case 'r':
-            control = RANGE;
-            break;
+    dashboard_redraw();
+}
 
-        case 'l':
-            control = LIGHT;
-            break;
+gboolean dashboard_sigwinch(gpointer data) {
 
-        case 'h':
-            control = HOLD;
-            break;
+    dashboard_resize();
 
-        case 'b':
-            control = BLUETOOTH_OFF;
-            break;
+    return TRUE;
+}
 
-        case 'd':
-            control = RELATIVE;
-            break;
+// Update the dashboard status line
+void dashboard_set_status(const char *status) {
 
-        case 'f':
-            control = HZ;
-            break;
+    strncpy(dashboard_status, status, sizeof(dashboard_status) - 1);
+    dashboard_refresh();
+}
 
-        case 'm':
-            control = MIN_MAX;
-            break;
+// Report an error, on the status line while the dashboard is drawn on the terminal
+void report_error(const char *format, ...) {
 
-        case 'n':
-            control = NORMAL;
-            break;
+    va_list args;
+    gchar *text;
 
-        default:
-            return TRUE;
+    va_start(args, format);
+    text = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    if ((dashboard_fd >= 0) && isatty(STDERR_FILENO)) {
+        dashboard_set_status(text);
+    } else {
+        fprintf(stderr, "%s\n", text);
     }
 
+    g_free(text);
+}
+
+// Update the connection state of a meter
+void dashboard_link(const char *device, enum link_state link) {
 
-    if (gattlib_write_char_by_uuid(connection, &g_control_uuid, &control, sizeof(control))) {
-        fprintf(stderr, "Failed to send control.\n");
-    }
+    struct panel *panel;
 
+    if (!dashboard || !device || !(panel = dashboard_panel(device))) return;
 
-	return TRUE;
+    if (panel->link == link) return;
+
+    panel->link = link;
+
+    dashboard_refresh();
 }
 
-// Handler for new device discovery
-static void ble_discovered_device(const char* addr, const char* name) {
+// Record a new reading on the dashboard
+void dashboard_update(const char *device, struct sample *sample) {
 
-    if ((name != NULL) && (strcmp(BDM, name) == 0) && (address == NULL)) {
+    struct panel *panel = dashboard_panel(device);
 
-        if (!quiet) fprintf(stderr, "Found %s\n", addr);
+    if (!panel) return;
 
-        address = malloc(18);
-        strcpy(address,addr);
-   }
+    panel->valid = TRUE;
+    panel->link = link_connected;
+    panel->function = sample->function;
+    panel->scale = sample->scale;
+    panel->decimal = sample->decimal;
+    panel->measurement = sample->measurement;
+    panel->type = sample->type;
+
+    // Keep history in base units so autoranging does not distort the sparkline
+    panel->history[panel->history_head] = (sample->decimal > 3) ? NAN :
+        sample->measurement * pow(10.0, (sample->scale - 4) * 3);
+    panel->history_head = (panel->history_head + 1) % DASHBOARD_HISTORY;
+    if (panel->history_count < DASHBOARD_HISTORY) panel->history_count++;
 
+    dashboard_invalidate();
 }
 
+// Restore the terminal when exiting
+void dashboard_stop() {
 
-// Connect to bluetooth multimeter
-void connect_device() {
+    if (dashboard_fd < 0) return;
 
-    do {
-        if (!quiet) fprintf(stderr, "Connecting...\n");
-        connection = gattlib_connect(NULL, address, BDADDR_LE_PUBLIC, BT_SEC_LOW, 0, 0);
-        if (connection == NULL) {
-            if (!quiet) fprintf(stderr, "Fail to connect to the multimeter bluetooth device.\n");
-            sleep(1);
-        }
-    } while (connection == NULL);
+    if (write(dashboard_fd, "\033[?25h\033[?1049l", 14) < 0) {
+        // Terminal has gone
+    }
 
+    if (dashboard_fd != STDOUT_FILENO) close(dashboard_fd);
+    dashboard_fd = -1;
 }
 
-// Start the notification listener
-void start_listener() {
-    gattlib_register_notification(connection, notification_handler, NULL);
+// Switch the terminal to a full screen dashboard
+void dashboard_start() {
 
-    int ret = gattlib_notification_start(connection, &g_measurement_uuid);
-    if (ret) {
-        fprintf(stderr, "Fail to start listener.\n");
+    dashboard_fd = open("/dev/tty", O_WRONLY | O_NOCTTY);
+    if (dashboard_fd < 0) {
+        fprintf(stderr, "ERROR: Dashboard requires a terminal.\n");
         exit(1);
     }
-}
 
-// Attempt to reconnect to the bluetooth multimeter
-void reconnect_device() {
+    // Readings would overwrite the dashboard unless they are redirected
+    if (isatty(STDOUT_FILENO)) dashboard_stdout = TRUE;
 
-    gattlib_disconnect(connection);
-    connect_device();
-    gattlib_register_notification(connection, notification_handler, NULL);
+    // Status messages are shown on the dashboard instead
+    if (isatty(STDERR_FILENO)) quiet = TRUE;
 
-}
+    if (write(dashboard_fd, "\033[?1049h\033[?25l", 14) < 0) {
+        fprintf(stderr, "ERROR: Failed to initialise dashboard.\n");
+        exit(1);
+    }
 
+    atexit(dashboard_stop);
 
-// Connection watchdog
+    g_unix_signal_add(SIGWINCH, dashboard_sigwinch, NULL);
 
-guint timeout_sec = 5;
+    dashboard_resize();
+}
 
-gboolean watchdog_check(gpointer data) {
+// Output sinks
+#define MAX_SINKS           8
+#define SINK_BUFFER_LIMIT   65536   // Output queued for a slow sink before readings are dropped
+
+struct sink {
+    const char *destination;
+    int fd;
+    _Bool socket;                   // Write with send() so a closed connection doesn't raise SIGPIPE
+    GIOChannel *channel;
+    guint watch;
+    GString *buffer;
+    struct output_options options;
+    unsigned long written;
+    unsigned long dropped;
+
+    // Log files are written by their own thread
+    _Bool log;
+    gchar *path;                    // Current file name
+    off_t size;
+    time_t rotate_at;
+    gint64 synced;
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    _Bool stop;
+    _Bool reopen;
+
+    unsigned long segments;
+    unsigned long syncs;
+    gint64 write_time;              // Microseconds spent writing
+    gint64 sync_time;               // Microseconds spent syncing to disk
+    gint64 sync_max;
+};
+
+struct sink sinks[MAX_SINKS];
+int num_sinks = 0;
+
+// Log files
+#define LOG_BUFFER_LIMIT    (1024 * 1024)   // Output queued for a log file before readings are dropped
+#define LOG_COMMIT          (64 * 1024)     // Output queued before waking the writer early
+
+unsigned long long rotate_size = 0;         // Bytes in a log file before starting a new one
+unsigned long rotate_time = 0;              // Seconds between new log files
+unsigned long fsync_interval = 0;           // Seconds between syncing log files to disk
+_Bool compress_logs = FALSE;
+
+// Expand the log file name template with the current local time
+void log_name(struct sink *sink, char *name, size_t length) {
+
+    time_t now = time(NULL);
+    struct tm local;
+
+    localtime_r(&now, &local);
+
+    if (!strchr(sink->destination, '%') || !strftime(name, length, sink->destination, &local)) {
+        g_strlcpy(name, sink->destination, length);
+    }
+}
 
-    if (!active) {
-        if (!quiet) fprintf(stderr, "Timeout\n");
+// Compress a closed log file in the background
+void log_compress(const char *path) {
 
-        reconnect_device();
-    }
+    gchar *argv[] = {"gzip", "-f", (gchar *)path, NULL};
+    GError *error = NULL;
 
-    active = FALSE;
-    return TRUE;
+    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, &error)) {
+        fprintf(stderr, "ERROR: Failed to compress %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
 }
 
-// SIGINT handler for clean shutdown
-void signal_handler(int signal){
+// Sync a log file to disk, tracking how long it takes
+void log_sync(struct sink *sink) {
 
-    g_main_loop_quit(loop);
-}
+    gint64 start = g_get_monotonic_time();
+    gint64 elapsed;
 
-int main(int argc, char *argv[]) {
-    int ret;
-    GIOChannel *pchan;
+    if (fsync(sink->fd) < 0) fprintf(stderr, "ERROR: Failed to sync %s.\n", sink->path);
 
-    _Bool scan = TRUE;
+    elapsed = g_get_monotonic_time() - start;
 
-    const char* adapter_name = NULL;
-    void* adapter = NULL;
+    g_mutex_lock(&sink->lock);
+    sink->syncs++;
+    sink->sync_time += elapsed;
+    if (elapsed > sink->sync_max) sink->sync_max = elapsed;
+    g_mutex_unlock(&sink->lock);
 
+    sink->synced = g_get_monotonic_time();
+}
 
-    if ((argc > 3) && (argv[1][0] == '-') && (argv[1][1] == 'R')) {
+// Open the log file, appending unless starting a new file under the same name
+int log_open(struct sink *sink, _Bool truncate) {
 
-        // Offline recording
-        interval = strtoul(argv[2], NULL, 0);
-        if (interval < 1) {
-            fprintf(stderr, "Measurement interval must be 1 or more seconds.\n");
-            return 1;
-        }
+    char name[PATH_MAX];
+    struct stat info;
+    time_t now = time(NULL);
 
+    log_name(sink, name, sizeof(name));
 
-        num_measurements = strtoul(argv[3], NULL, 0);
-        if ((num_measurements < 1) || (num_measurements > MAX_MEASUREMENTS)) {
-            fprintf(stderr, "Number of measurements must be between 0 and %d.\n", MAX_MEASUREMENTS);
+    sink->fd = open(name, O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+    if (sink->fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open output %s.\n", name);
+        return 1;
+    }
+
+    g_free(sink->path);
+    sink->path = g_strdup(name);
+    sink->size = (fstat(sink->fd, &info) == 0) ? info.st_size : 0;
+
+    // Time based files start on a multiple of the rotation time
+    if (rotate_time) sink->rotate_at = (now / rotate_time + 1) * rotate_time;
+
+    g_mutex_lock(&sink->lock);
+    sink->segments++;
+    g_mutex_unlock(&sink->lock);
+
+    return 0;
+}
+
+// Check whether a closed log file name is already used, either as is or compressed
+_Bool log_exists(const char *path) {
+
+    gchar *compressed = g_strconcat(path, ".gz", NULL);
+    _Bool exists = (access(path, F_OK) == 0) || (compress_logs && (access(compressed, F_OK) == 0));
+
+    g_free(compressed);
+
+    return exists;
+}
+
+// Close the current log file and start the next
+void log_rotate(struct sink *sink) {
+
+    char name[PATH_MAX];
+    gchar *closed = g_strdup(sink->path);
+
+    // A file name with no time template keeps its name, the closed file is renamed with the time
+    log_name(sink, name, sizeof(name));
+
+    if ((strcmp(name, sink->path) == 0) && strchr(sink->destination, '%')) {
+        // Template hasn't changed since the file was opened - number the closed file instead
+        for (int n = 1; log_exists(closed); n++) {
+            g_free(closed);
+            closed = g_strdup_printf("%s.%d", sink->path, n);
+        }
+
+        if (rename(sink->path, closed) < 0) {
+            fprintf(stderr, "ERROR: Failed to rename %s.\n", sink->path);
+        }
+    } else if (strcmp(name, sink->path) == 0) {
+        time_t now = time(NULL);
+        struct tm local;
+        char suffix[32];
+
+        localtime_r(&now, &local);
+        strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &local);
+
+        g_free(closed);
+        closed = g_strconcat(sink->path, suffix, NULL);
+
+        // Don't overwrite a file closed earlier in the same second
+        for (int n = 1; log_exists(closed); n++) {
+            g_free(closed);
+            closed = g_strdup_printf("%s%s.%d", sink->path, suffix, n);
+        }
+
+        if (rename(sink->path, closed) < 0) {
+            fprintf(stderr, "ERROR: Failed to rename %s.\n", sink->path);
+        }
+    }
+
+    if (fsync_interval) log_sync(sink);
+    close(sink->fd);
+
+    if (compress_logs) log_compress(closed);
+    g_free(closed);
+
+    log_open(sink, FALSE);
+}
+
+// Write to the log file, tracking how long it takes
+void log_write(struct sink *sink, const char *text, gsize length) {
+
+    gint64 start = g_get_monotonic_time();
+    gsize written = 0;
+
+    while (written < length) {
+        ssize_t ret = write(sink->fd, text + written, length - written);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ERROR: Failed to write %s.\n", sink->path);
+            break;
+        }
+
+        written += ret;
+    }
+
+    sink->size += written;
+
+    g_mutex_lock(&sink->lock);
+    sink->written += written;
+    sink->write_time += g_get_monotonic_time() - start;
+    g_mutex_unlock(&sink->lock);
+}
+
+// Log writer thread - writes queued output at least once a second and syncs it to disk
+// at the fsync interval, so a bounded amount is lost if the power fails
+gpointer log_writer(gpointer data) {
+
+    struct sink *sink = data;
+    GString *pending = g_string_new(NULL);
+    _Bool stop, reopen;
+
+    sink->synced = g_get_monotonic_time();
+
+    do {
+        g_mutex_lock(&sink->lock);
+
+        if (!sink->stop && !sink->reopen && (sink->buffer->len < LOG_COMMIT)) {
+            g_cond_wait_until(&sink->cond, &sink->lock, g_get_monotonic_time() + G_USEC_PER_SEC);
+        }
+
+        // Swap buffers so readings can be queued while writing
+        GString *full = sink->buffer;
+        sink->buffer = pending;
+        pending = full;
+
+        stop = sink->stop;
+        reopen = sink->reopen;
+        sink->reopen = FALSE;
+
+        g_mutex_unlock(&sink->lock);
+
+        // Retry a file that failed to open
+        if (sink->fd < 0) log_open(sink, FALSE);
+
+        gsize offset = 0;
+
+        while ((offset < pending->len) && (sink->fd >= 0)) {
+            const char *text = pending->str + offset;
+            gsize length = pending->len - offset;
+
+            // Split at a line boundary so files don't grow past the rotation size
+            if (rotate_size && (sink->size + length > rotate_size)) {
+                const char *end = NULL;
+
+                if (sink->size < rotate_size) end = g_strrstr_len(text, rotate_size - sink->size, "\n");
+
+                if (!end && sink->size) {
+                    log_rotate(sink);
+                    continue;
+                }
+
+                // A line longer than the rotation size still has to go somewhere
+                if (!end) end = memchr(text, '\n', length);
+                if (end) length = end - text + 1;
+            }
+
+            log_write(sink, text, length);
+            offset += length;
+        }
+
+        // Measurements that couldn't be written because the file isn't open are lost
+        if (offset < pending->len) {
+            unsigned long lines = 0;
+
+            for (const char *end = pending->str + offset; (end = memchr(end, '\n',
+                    pending->str + pending->len - end)); end++) {
+                lines++;
+            }
+
+            g_mutex_lock(&sink->lock);
+            sink->dropped += lines;
+            g_mutex_unlock(&sink->lock);
+        }
+
+        g_string_truncate(pending, 0);
+
+        if (sink->fd < 0) continue;
+
+        if (fsync_interval && (g_get_monotonic_time() - sink->synced >= fsync_interval * G_USEC_PER_SEC)) {
+            log_sync(sink);
+        }
+
+        if (reopen) {
+            // Files have been moved away by an external log rotation
+            if (fsync_interval) log_sync(sink);
+            close(sink->fd);
+            log_open(sink, FALSE);
+
+        } else if ((rotate_size && (sink->size >= rotate_size)) ||
+                (rotate_time && (time(NULL) >= sink->rotate_at))) {
+            log_rotate(sink);
+        }
+
+    } while (!stop);
+
+    if (sink->fd >= 0) {
+        if (fsync_interval) log_sync(sink);
+        close(sink->fd);
+    }
+
+    g_string_free(pending, TRUE);
+
+    return NULL;
+}
+
+// Queue output for a log file
+void log_send(struct sink *sink, const char *text, gsize length) {
+
+    g_mutex_lock(&sink->lock);
+
+    if (sink->buffer->len + length > LOG_BUFFER_LIMIT) {
+        sink->dropped++;
+    } else {
+        g_string_append_len(sink->buffer, text, length);
+        if (sink->buffer->len >= LOG_COMMIT) g_cond_signal(&sink->cond);
+    }
+
+    g_mutex_unlock(&sink->lock);
+}
+
+// Open a log file and start its writer
+int log_start(struct sink *sink) {
+
+    sink->log = TRUE;
+    sink->buffer = g_string_new(NULL);
+
+    // An existing file with a fixed name is replaced, as with a redirect
+    if (log_open(sink, !strchr(sink->destination, '%'))) return 1;
+
+    sink->thread = g_thread_new("log_writer", log_writer, sink);
+
+    return 0;
+}
+
+// Write out the remaining output and stop the writer
+void log_end(struct sink *sink) {
+
+    g_mutex_lock(&sink->lock);
+    sink->stop = TRUE;
+    g_cond_signal(&sink->cond);
+    g_mutex_unlock(&sink->lock);
+
+    g_thread_join(sink->thread);
+
+    g_string_free(sink->buffer, TRUE);
+    g_free(sink->path);
+}
+
+// SIGHUP handler - reopen log files after they have been moved by an external log rotation
+gboolean log_reopen_signal(gpointer data) {
+
+    for (int i = 0; i < num_sinks; i++) {
+        if (!sinks[i].log) continue;
+
+        g_mutex_lock(&sinks[i].lock);
+        sinks[i].reopen = TRUE;
+        g_cond_signal(&sinks[i].cond);
+        g_mutex_unlock(&sinks[i].lock);
+    }
+
+    return TRUE;
+}
+
+// Report log file throughput and sync latency
+void log_stats(struct sink *sink, GString *line) {
+
+    g_mutex_lock(&sink->lock);
+
+    g_string_append_printf(line, " files %lu write %.2f MB/s", sink->segments,
+        sink->write_time ? (double)sink->written / sink->write_time : 0.0);
+
+    if (sink->syncs) {
+        g_string_append_printf(line, " fsyncs %lu avg %.2f ms max %.2f ms", sink->syncs,
+            sink->sync_time / 1000.0 / sink->syncs, sink->sync_max / 1000.0);
+    }
+
+    g_mutex_unlock(&sink->lock);
+}
+
+
+// Send queued output to a sink without blocking
+void sink_flush(struct sink *sink) {
+
+    while (sink->buffer->len) {
+        ssize_t sent;
+
+        if (sink->socket) {
+            sent = send(sink->fd, sink->buffer->str, sink->buffer->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else {
+            sent = write(sink->fd, sink->buffer->str, sink->buffer->len);
+        }
+
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+
+            // Destination has gone - discard output
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) g_string_truncate(sink->buffer, 0);
+
+            return;
+        }
+
+        sink->written += sent;
+        g_string_erase(sink->buffer, 0, sent);
+    }
+}
+
+// Event handler for sink becoming writable
+gboolean sink_writable(GIOChannel *chan, GIOCondition cond, gpointer user_data) {
+
+    struct sink *sink = user_data;
+
+    sink_flush(sink);
+
+    if (sink->buffer->len) return TRUE;
+
+    sink->watch = 0;
+    return FALSE;
+}
+
+// Queue output for a sink regardless of how much is already queued
+void sink_queue(struct sink *sink, const char *text, gsize length) {
+
+    g_string_append_len(sink->buffer, text, length);
+
+    if (sink->watch) return;
+
+    sink_flush(sink);
+
+    if (sink->buffer->len) {
+        sink->watch = g_io_add_watch(sink->channel, G_IO_OUT, sink_writable, sink);
+    }
+}
+
+// Queue output for a sink
+void sink_send(struct sink *sink, const char *text, gsize length) {
+
+    if (sink->log) {
+        log_send(sink, text, length);
+        return;
+    }
+
+    if (sink->buffer->len + length > SINK_BUFFER_LIMIT) {
+        sink->dropped++;
+        return;
+    }
+
+    sink_queue(sink, text, length);
+}
+
+// Set up a sink for an open socket, pipe or file
+void sink_init(struct sink *sink, int fd) {
+
+    sink->fd = fd;
+    sink->buffer = g_string_new(NULL);
+    sink->channel = g_io_channel_unix_new(fd);
+    g_io_channel_set_close_on_unref(sink->channel, fd != STDOUT_FILENO);
+}
+
+// Release a sink, closing its destination
+void sink_free(struct sink *sink) {
+
+    if (sink->watch) g_source_remove(sink->watch);
+    g_io_channel_unref(sink->channel);
+    g_string_free(sink->buffer, TRUE);
+}
+
+// Add a sink from a command line <options>:<destination> specification
+_Bool add_sink(char *spec) {
+
+    struct sink *sink;
+    char *destination = strchr(spec, ':');
+
+    if (num_sinks == MAX_SINKS) {
+        fprintf(stderr, "Too many outputs, limit is %d.\n", MAX_SINKS);
+        return FALSE;
+    }
+
+    sink = &sinks[num_sinks];
+    sink->options = (struct output_options){space, none, 0, TRUE, FALSE, 0};
+
+    if (destination) {
+        for (char *option = spec; option < destination; option++) {
+            if (!set_output_option(&sink->options, *option)) {
+                fprintf(stderr, "Unknown output option %c\n", *option);
+                return FALSE;
+            }
+        }
+        destination++;
+    } else {
+        destination = spec;
+    }
+
+    if (*destination == '\0') {
+        fprintf(stderr, "Missing output destination\n");
+        return FALSE;
+    }
+
+    sink->destination = destination;
+    num_sinks++;
+
+    return TRUE;
+}
+
+// Open the sink destinations
+int sinks_open() {
+
+    for (int i = 0; i < num_sinks; i++) {
+        struct sink *sink = &sinks[i];
+        struct stat info;
+        int fd;
+
+        if (strcmp(sink->destination, "-") == 0) {
+
+            // A slow reader of a pipe mustn't hold up the other outputs, but on its own stdout
+            // blocks as it always has so nothing piped from it is lost.  Terminals are left as
+            // they are.
+            fd = STDOUT_FILENO;
+            if ((num_sinks > 1) && (fstat(fd, &info) == 0) && S_ISFIFO(info.st_mode)) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+
+        } else if ((stat(sink->destination, &info) == 0) && S_ISFIFO(info.st_mode)) {
+
+            // Opening for read as well means there is no need to wait for a reader, and
+            // readers can come and go without the write failing
+            fd = open(sink->destination, O_RDWR | O_NONBLOCK);
+
+        } else {
+            if (log_start(sink)) return 1;
+            continue;
+        }
+
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: Failed to open output %s.\n", sink->destination);
             return 1;
         }
 
-        if (argc == 5) {
-            address = argv[4];
-            scan = FALSE;
+        sink_init(sink, fd);
+    }
+
+    return 0;
+}
+
+// Write out remaining output and close the sink destinations
+void sinks_close() {
+
+    for (int i = 0; i < num_sinks; i++) {
+        struct sink *sink = &sinks[i];
+
+        if (sink->log) {
+            GString *line = g_string_new(NULL);
+
+            log_end(sink);
+
+            if (!quiet) {
+                g_string_printf(line, "Output %s: %lu bytes, %lu dropped,", sink->destination,
+                    sink->written, sink->dropped);
+                log_stats(sink, line);
+                fprintf(stderr, "%s\n", line->str);
+            }
+
+            g_string_free(line, TRUE);
+            continue;
+        }
+
+        // Wait for a slow reader of stdout to catch up, as if it had been written directly
+        if (sink->buffer->len && (sink->fd == STDOUT_FILENO)) {
+            fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) & ~O_NONBLOCK);
+            sink_flush(sink);
+        }
+
+        if (!quiet && ((num_sinks > 1) || sink->dropped)) {
+            fprintf(stderr, "Output %s: %lu bytes, %lu dropped\n", sink->destination,
+                sink->written, sink->dropped);
+        }
+
+        sink_free(sink);
+    }
+}
+
+// Send measurement to all output sinks
+void sinks_publish(struct sample *sample) {
+
+    static GString *line = NULL;
+
+    if (!line) line = g_string_new(NULL);
+
+    for (int i = 0; i < num_sinks; i++) {
+        struct sink *sink = &sinks[i];
+
+        // Dashboard is drawn on the terminal
+        if (dashboard_stdout && (sink->fd == STDOUT_FILENO)) continue;
+
+        g_string_truncate(line, 0);
+        format_reading(line, &sink->options, sample);
+        sink_send(sink, line->str, line->len);
+    }
+}
+
+
+// Control socket
+char *control_socket = NULL;
+int control_fd = -1;
+
+#define CLIENT_LINE_LIMIT   1024
+
+struct client {
+    guint input_watch;
+    GString *input;
+    _Bool subscribed;
+    struct sink sink;               // Replies and subscribed measurements
+};
+
+GList *clients = NULL;
+
+unsigned long packets = 0;
+struct sample last_sample;
+_Bool have_sample = FALSE;
+
+// Send measurement to all subscribed clients
+void clients_publish(struct sample *sample) {
+
+    static GString *line = NULL;
+
+    if (!line) line = g_string_new(NULL);
+
+    for (GList *item = clients; item; item = item->next) {
+        struct client *client = item->data;
+
+        if (!client->subscribed) continue;
+
+        g_string_truncate(line, 0);
+        format_reading(line, &client->sink.options, sample);
+        sink_send(&client->sink, line->str, line->len);
+    }
+}
+
+// Raw packet capture
+#define CAPTURE_BUFFER      (1024 * 1024)   // Bytes buffered before packets are dropped
+#define CAPTURE_FLUSH       (64 * 1024)     // Bytes buffered before waking the writer
+#define CAPTURE_SENT        0
+#define CAPTURE_RECEIVED    1
+
+#define ATT_READ_RESPONSE   0x0b
+#define ATT_WRITE_REQUEST   0x12
+#define ATT_NOTIFICATION    0x1b
+
+#define BTSNOOP_H4          1002
+#define PCAP_H4_WITH_PHDR   201
+#define BTSNOOP_EPOCH_DELTA 0x00dcddb30f2f8000ULL   // Microseconds from 0 AD to Unix epoch
+
+char *capture_file = NULL;
+_Bool capture_pcap = FALSE;
+int capture_fd = -1;
+
+// Buffer between the notification path and the writer thread
+struct {
+    uint8_t *buffer;
+    size_t length;
+    _Bool stop;
+    GMutex lock;
+    GCond cond;
+    GThread *thread;
+
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long dropped;
+    gint64 time;                    // Microseconds spent queueing packets
+} capture;
+
+void put_be32(uint8_t *buffer, uint32_t value) {
+
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+// Queue an ATT packet for capture as an HCI ACL packet
+void capture_packet(struct meter *meter, int direction, uint8_t opcode, const uuid_t *uuid,
+        const uint8_t *data, size_t data_length) {
+
+    uint8_t record[24 + 12 + 48];
+    uint8_t *packet;
+    size_t header, pdu, length, size;
+    uint16_t handle = (meter - meters) + 1;     // Each meter gets its own connection handle
+    gint64 start = g_get_monotonic_time();
+    gint64 now = g_get_real_time();
+
+    if (data_length > 48) data_length = 48;
+
+    header = capture_pcap ? 20 : 24;
+    packet = record + header;
+
+    // ATT PDU - the characteristic UUID stands in for the attribute handle, which is not known.
+    // Read responses carry no handle.
+    packet[9] = opcode;
+    if (opcode == ATT_READ_RESPONSE) {
+        memcpy(packet + 10, data, data_length);
+        pdu = 1 + data_length;
+    } else {
+        packet[10] = uuid->value.uuid16 & 0xff;
+        packet[11] = uuid->value.uuid16 >> 8;
+        memcpy(packet + 12, data, data_length);
+        pdu = 3 + data_length;
+    }
+
+    // H4 ACL header, first automatically flushable fragment, then L2CAP header on the ATT channel
+    packet[0] = 0x02;
+    packet[1] = handle & 0xff;
+    packet[2] = ((handle >> 8) & 0x0f) | 0x20;
+    packet[3] = (4 + pdu) & 0xff;
+    packet[4] = (4 + pdu) >> 8;
+    packet[5] = pdu & 0xff;
+    packet[6] = pdu >> 8;
+    packet[7] = 0x04;
+    packet[8] = 0x00;
+
+    length = 9 + pdu;
+
+    // Record header - the pcap direction pseudo header counts as part of the packet
+    if (capture_pcap) {
+        *(uint32_t *)(record) = now / G_USEC_PER_SEC;
+        *(uint32_t *)(record + 4) = now % G_USEC_PER_SEC;
+        *(uint32_t *)(record + 8) = length + 4;
+        *(uint32_t *)(record + 12) = length + 4;
+        put_be32(record + 16, direction);
+    } else {
+        uint64_t timestamp = now + BTSNOOP_EPOCH_DELTA;
+
+        put_be32(record, length);
+        put_be32(record + 4, length);
+        put_be32(record + 8, direction);
+        put_be32(record + 12, capture.dropped);
+        put_be32(record + 16, timestamp >> 32);
+        put_be32(record + 20, timestamp);
+    }
+
+    g_mutex_lock(&capture.lock);
+
+    size = header + length;
+    if (capture.length + size > CAPTURE_BUFFER) {
+        capture.dropped++;
+    } else {
+        memcpy(capture.buffer + capture.length, record, size);
+        capture.length += size;
+        capture.packets++;
+        capture.bytes += size;
+
+        if (capture.length >= CAPTURE_FLUSH) g_cond_signal(&capture.cond);
+    }
+
+    capture.time += g_get_monotonic_time() - start;
+
+    g_mutex_unlock(&capture.lock);
+}
+
+// Capture writer thread - writes buffered packets at least once a second
+gpointer capture_writer(gpointer data) {
+
+    uint8_t *buffer = g_malloc(CAPTURE_BUFFER);
+    size_t length;
+    _Bool stop;
+
+    do {
+        g_mutex_lock(&capture.lock);
+
+        if (!capture.stop && (capture.length < CAPTURE_FLUSH)) {
+            g_cond_wait_until(&capture.cond, &capture.lock, g_get_monotonic_time() + G_USEC_PER_SEC);
+        }
+
+        // Swap buffers so the notification path is never held up by the write
+        uint8_t *full = capture.buffer;
+        capture.buffer = buffer;
+        buffer = full;
+        length = capture.length;
+        capture.length = 0;
+        stop = capture.stop;
+
+        g_mutex_unlock(&capture.lock);
+
+        for (size_t written = 0; written < length; ) {
+            ssize_t ret = write(capture_fd, buffer + written, length - written);
+
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "ERROR: Failed to write capture file.\n");
+                break;
+            }
+
+            written += ret;
+        }
+
+    } while (!stop);
+
+    g_free(buffer);
+
+    return NULL;
+}
+
+// Write out remaining packets and close the capture file
+void capture_end() {
+
+    g_mutex_lock(&capture.lock);
+    capture.stop = TRUE;
+    g_cond_signal(&capture.cond);
+    g_mutex_unlock(&capture.lock);
+
+    g_thread_join(capture.thread);
+    close(capture_fd);
+
+    if (!quiet) {
+        fprintf(stderr, "Captured %lu packets, %lu bytes, %lu dropped, %.2f us per packet\n",
+            capture.packets, capture.bytes, capture.dropped,
+            (capture.packets + capture.dropped) ?
+                (double)capture.time / (capture.packets + capture.dropped) : 0.0);
+    }
+}
+
+// Open the capture file and start the writer
+int capture_start() {
+
+    uint8_t header[24];
+    size_t length;
+    const char *extension = strrchr(capture_file, '.');
+
+    capture_pcap = extension && (strcmp(extension, ".pcap") == 0);
+
+    capture_fd = open(capture_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture_fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open capture file %s.\n", capture_file);
+        return 1;
+    }
+
+    if (capture_pcap) {
+        *(uint32_t *)(header) = 0xa1b2c3d4;
+        *(uint16_t *)(header + 4) = 2;
+        *(uint16_t *)(header + 6) = 4;
+        *(uint32_t *)(header + 8) = 0;
+        *(uint32_t *)(header + 12) = 0;
+        *(uint32_t *)(header + 16) = 65535;
+        *(uint32_t *)(header + 20) = PCAP_H4_WITH_PHDR;
+        length = 24;
+    } else {
+        memcpy(header, "btsnoop\0", 8);
+        put_be32(header + 8, 1);
+        put_be32(header + 12, BTSNOOP_H4);
+        length = 16;
+    }
+
+    if (write(capture_fd, header, length) != length) {
+        fprintf(stderr, "ERROR: Failed to write capture file %s.\n", capture_file);
+        return 1;
+    }
+
+    capture.buffer = g_malloc(CAPTURE_BUFFER);
+    g_mutex_init(&capture.lock);
+    g_cond_init(&capture.cond);
+    capture.thread = g_thread_new("capture", capture_writer, NULL);
+
+    atexit(capture_end);
+
+    return 0;
+}
+
+// Write to a characteristic, capturing the packet if enabled
+int meter_write(struct meter *meter, uuid_t *uuid, const void *buffer, size_t length) {
+
+    if (capture_file) capture_packet(meter, CAPTURE_SENT, ATT_WRITE_REQUEST, uuid, buffer, length);
+
+    return gattlib_write_char_by_uuid(meter->connection, uuid, buffer, length);
+}
+
+// Read a characteristic, capturing the packet if enabled
+int meter_read(struct meter *meter, uuid_t *uuid, void *buffer, size_t *length) {
+
+    int ret = gattlib_read_char_by_uuid(meter->connection, uuid, buffer, length);
+
+    if (capture_file && !ret) capture_packet(meter, CAPTURE_RECEIVED, ATT_READ_RESPONSE, uuid, buffer, *length);
+
+    return ret;
+}
+
+// Alarm rules
+#define MAX_RULES   16
+
+enum rule_test {rule_above, rule_below, rule_outside, rule_rate};
+enum rule_action {action_log, action_fifo, action_exec, action_control, action_exit};
+
+struct rule_state {
+    unsigned int matched;
+    _Bool fired;                    // Rule doesn't fire again until back within limits
+    _Bool have_last;
+    double last;
+    gint64 last_time;
+};
+
+struct rule {
+    const char *text;
+    char *condition;                // Rule text without the action for reporting events
+    uint16_t functions;             // Bit mask of the meter functions the rule applies to
+    enum rule_test test;
+    double low;                     // Limits in base units, or per second for rate of change
+    double high;
+    unsigned int count;             // Consecutive samples out of limits before the rule fires
+
+    enum rule_action action;
+    char *argument;
+    uint16_t control;
+    int code;
+    struct sink *fifo;
+
+    struct rule_state state[MAX_METERS];
+
+    unsigned long fired;
+    gint64 latency;                 // Microseconds from notification to action complete
+    gint64 latency_max;
+};
+
+struct rule rules[MAX_RULES];
+int num_rules = 0;
+
+int exit_status = 0;
+
+// Events are timestamped and identify the meter
+struct output_options rule_output = {space, date, 0, TRUE, TRUE, 0};
+
+// Multipliers to base units for each measurement scale
+const double scale_factor[] = {1.0, 1e-9, 1e-6, 1e-3, 1.0, 1e3, 1e6, 1.0};
+
+// Parse a rule limit, with an optional n, u, m, k or M scale suffix
+_Bool parse_limit(const char *text, double *limit) {
+
+    char *end;
+
+    if (!text) return FALSE;
+
+    *limit = strtod(text, &end);
+    if (end == text) return FALSE;
+
+    for (int scale = 1; *end && (scale < 7); scale++) {
+        if ((scale != 4) && (*end == scale_prefix[scale][0])) {
+            *limit *= scale_factor[scale];
+            end++;
+            break;
+        }
+    }
+
+    return *end == '\0';
+}
+
+// Open the FIFO or file an alarm rule writes events to
+struct sink *rule_fifo(const char *path) {
+
+    struct sink *sink;
+    struct stat info;
+    int fd;
+
+    if ((stat(path, &info) == 0) && S_ISFIFO(info.st_mode)) {
+        fd = open(path, O_RDWR | O_NONBLOCK);
+    } else {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open alarm output %s.\n", path);
+        return NULL;
+    }
+
+    sink = g_new0(struct sink, 1);
+    sink_init(sink, fd);
+    sink->destination = g_strdup(path);
+
+    return sink;
+}
+
+// Compile an alarm rule
+//   <units> > <limit> | < <limit> | outside <low> <high> | rate > <limit> [for <samples>]
+//       : log | fifo <path> | exec <command> | control <name> | exit <code>
+_Bool add_rule(const char *text) {
+
+    struct rule *rule;
+    char *copy, *action, *token, *argument, *saveptr;
+    const char *error = NULL;
+
+    if (num_rules == MAX_RULES) {
+        fprintf(stderr, "Too many alarm rules, limit is %d.\n", MAX_RULES);
+        return FALSE;
+    }
+
+    rule = &rules[num_rules];
+    rule->text = text;
+    rule->count = 1;
+
+    copy = g_strdup(text);
+
+    if (!(action = strchr(copy, ':'))) {
+        error = "missing action";
+        goto fail;
+    }
+    *action++ = '\0';
+
+    rule->condition = g_strstrip(g_strdup(copy));
+
+    // Units select the meter functions
+    if (!(token = strtok_r(copy, " \t", &saveptr))) {
+        error = "missing units";
+        goto fail;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        if ((strcmp(token, "*") == 0) ||
+                (function_units[i][0] && (g_ascii_strcasecmp(token, function_units[i]) == 0))) {
+            rule->functions |= 1 << i;
+        }
+    }
+
+    if (!rule->functions) {
+        error = "unknown units";
+        goto fail;
+    }
+
+    // Condition
+    token = strtok_r(NULL, " \t", &saveptr);
+
+    if (token && (strcmp(token, "rate") == 0)) {
+        rule->test = rule_rate;
+        token = strtok_r(NULL, " \t", &saveptr);
+        if (!token || (strcmp(token, ">") != 0) ||
+                !parse_limit(strtok_r(NULL, " \t", &saveptr), &rule->high)) error = "invalid rate";
+    } else if (token && (strcmp(token, ">") == 0)) {
+        rule->test = rule_above;
+        if (!parse_limit(strtok_r(NULL, " \t", &saveptr), &rule->high)) error = "invalid limit";
+    } else if (token && (strcmp(token, "<") == 0)) {
+        rule->test = rule_below;
+        if (!parse_limit(strtok_r(NULL, " \t", &saveptr), &rule->low)) error = "invalid limit";
+    } else if (token && (strcmp(token, "outside") == 0)) {
+        rule->test = rule_outside;
+        if (!parse_limit(strtok_r(NULL, " \t", &saveptr), &rule->low) ||
+                !parse_limit(strtok_r(NULL, " \t", &saveptr), &rule->high)) error = "invalid limits";
+    } else {
+        error = "unknown condition";
+    }
+
+    if (error) goto fail;
+
+    if ((token = strtok_r(NULL, " \t", &saveptr)) && (strcmp(token, "for") == 0)) {
+        token = strtok_r(NULL, " \t", &saveptr);
+        if (!token || ((rule->count = strtoul(token, NULL, 0)) < 1)) {
+            error = "invalid sample count";
+            goto fail;
+        }
+        token = strtok_r(NULL, " \t", &saveptr);
+    }
+
+    if (token) {
+        error = "unexpected condition";
+        goto fail;
+    }
+
+    // Action
+    token = strtok_r(action, " \t", &saveptr);
+    argument = strtok_r(NULL, "", &saveptr);
+    if (argument) argument = g_strstrip(argument);
+
+    if (token && (strcmp(token, "log") == 0)) {
+        rule->action = action_log;
+    } else if (token && (strcmp(token, "fifo") == 0) && argument) {
+        rule->action = action_fifo;
+        if (!(rule->fifo = rule_fifo(argument))) goto fail;
+    } else if (token && (strcmp(token, "exec") == 0) && argument) {
+        rule->action = action_exec;
+        rule->argument = g_strdup(argument);
+    } else if (token && (strcmp(token, "control") == 0) && argument) {
+        rule->action = action_control;
+        for (int i = 0; !rule->control && (i < G_N_ELEMENTS(control_names)); i++) {
+            if (g_ascii_strcasecmp(argument, control_names[i].name) == 0) rule->control = control_names[i].control;
+        }
+        if (!rule->control) error = "unknown control";
+    } else if (token && (strcmp(token, "exit") == 0)) {
+        rule->action = action_exit;
+        rule->code = argument ? strtol(argument, NULL, 0) : 1;
+    } else {
+        error = "unknown action";
+    }
+
+    if (error) goto fail;
+
+    g_free(copy);
+    num_rules++;
+
+    return TRUE;
+
+fail:
+    if (error) fprintf(stderr, "Invalid alarm rule '%s': %s\n", text, error);
+    g_free(rule->condition);
+    g_free(copy);
+    memset(rule, 0, sizeof(*rule));
+
+    return FALSE;
+}
+
+// Carry out the action for a rule that has fired
+void rule_fire(struct rule *rule, struct meter *meter, struct sample *sample, double value) {
+
+    static GString *event = NULL;
+    gint64 latency;
+
+    if (!event) event = g_string_new(NULL);
+
+    g_string_printf(event, "ALARM %s: ", rule->condition);
+    format_reading(event, &rule_output, sample);
+
+    switch (rule->action) {
+        case action_log:
+            if (dashboard) {
+                g_string_truncate(event, event->len - 1);
+                dashboard_set_status(event->str);
+            } else {
+                fputs(event->str, stderr);
+            }
+            break;
+
+        case action_fifo:
+            sink_send(rule->fifo, event->str, event->len);
+            break;
+
+        case action_exec: {
+            // Run the command without waiting for it, passing the event in the environment
+            gchar *argv[] = {"/bin/sh", "-c", rule->argument, NULL};
+            gchar **envp = g_get_environ();
+            gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+            GError *error = NULL;
+
+            g_string_truncate(event, event->len - 1);
+            envp = g_environ_setenv(envp, "OWONB35_EVENT", event->str, TRUE);
+            envp = g_environ_setenv(envp, "OWONB35_RULE", rule->condition, TRUE);
+            envp = g_environ_setenv(envp, "OWONB35_DEVICE", meter->address, TRUE);
+            envp = g_environ_setenv(envp, "OWONB35_VALUE", g_ascii_formatd(number, sizeof(number), "%g", value), TRUE);
+
+            if (!g_spawn_async(NULL, argv, envp, G_SPAWN_DEFAULT, NULL, NULL, NULL, &error)) {
+                report_error("ERROR: Failed to run alarm command: %s", error->message);
+                g_error_free(error);
+            }
+
+            g_strfreev(envp);
+            break;
+        }
+
+        case action_control:
+            if (meter_write(meter, &g_control_uuid, &rule->control, sizeof(rule->control))) {
+                report_error("ERROR: Failed to send alarm control to %s.", meter->address);
+            }
+            break;
+
+        case action_exit:
+            if (!quiet) fputs(event->str, stderr);
+            exit_status = rule->code;
+            g_main_loop_quit(loop);
+            break;
+    }
+
+    latency = g_get_monotonic_time() - meter->arrival;
+
+    rule->fired++;
+    rule->latency += latency;
+    if (latency > rule->latency_max) rule->latency_max = latency;
+}
+
+// Check a new measurement against the alarm rules
+void rules_check(struct meter *meter, struct sample *sample) {
+
+    int index = meter - meters;
+    _Bool overload = sample->decimal > 3;
+    double value = overload ? INFINITY : sample->measurement * scale_factor[sample->scale & 0x07];
+
+    for (int i = 0; i < num_rules; i++) {
+        struct rule *rule = &rules[i];
+        struct rule_state *state = &rule->state[index];
+        _Bool match = FALSE;
+
+        if (!(rule->functions & (1 << sample->function))) {
+            memset(state, 0, sizeof(*state));
+            continue;
+        }
+
+        switch (rule->test) {
+            case rule_above:
+                match = value > rule->high;
+                break;
+
+            case rule_below:
+                match = value < rule->low;
+                break;
+
+            case rule_outside:
+                match = (value < rule->low) || (value > rule->high);
+                break;
+
+            case rule_rate:
+                if (overload) {
+                    state->have_last = FALSE;
+                    break;
+                }
+
+                if (state->have_last && (meter->arrival > state->last_time)) {
+                    match = fabs(value - state->last) * G_USEC_PER_SEC /
+                        (meter->arrival - state->last_time) > rule->high;
+                }
+
+                state->have_last = TRUE;
+                state->last = value;
+                state->last_time = meter->arrival;
+                break;
+        }
+
+        if (!match) {
+            state->matched = 0;
+            state->fired = FALSE;
+            continue;
+        }
+
+        if (state->fired || (++state->matched < rule->count)) continue;
+
+        state->fired = TRUE;
+        rule_fire(rule, meter, sample, value);
+    }
+}
+
+// Report how often each rule fired and how quickly the actions were carried out
+void print_rule_stats() {
+
+    for (int i = 0; i < num_rules; i++) {
+        struct rule *rule = &rules[i];
+
+        fprintf(stderr, "Alarm '%s': fired %lu", rule->text, rule->fired);
+
+        if (rule->fired) {
+            fprintf(stderr, ", action latency avg %.2f ms max %.2f ms",
+                rule->latency / 1000.0 / rule->fired, rule->latency_max / 1000.0);
+        }
+
+        fprintf(stderr, "\n");
+    }
+}
+
+// Measurement history
+#define HISTORY_LEVELS      4
+#define HISTORY_POINTS_MAX  10000   // Largest number of points a query can ask for
+
+// Level 0 holds each measurement, coarser levels hold the min, max and mean over a period
+const struct {
+    gint64 period;                  // Microseconds per bucket
+    unsigned int size;              // Buckets kept
+} history_levels[HISTORY_LEVELS] = {
+    {0, 65536},                     // About 11 hours at 600ms per measurement
+    {10 * G_USEC_PER_SEC, 8640},    // 1 day
+    {60 * G_USEC_PER_SEC, 10080},   // 1 week
+    {600 * G_USEC_PER_SEC, 4320}    // 30 days
+};
+
+struct bucket {
+    gint64 start;                   // Microseconds since the epoch
+    float min;                      // Base units
+    float max;
+    double sum;
+    uint32_t count;
+    uint8_t function;
+    uint8_t scale;                  // Scale and decimal places of the latest measurement for display
+    uint8_t decimal;
+    uint16_t type;                  // Measurement type, level 0 only
+};
+
+struct history {
+    struct {
+        struct bucket *buckets;
+        unsigned int head;          // Next bucket to write
+        unsigned int count;
+    } levels[HISTORY_LEVELS];
+};
+
+// Get a bucket by age order, 0 being the oldest
+struct bucket *history_bucket(struct history *history, int level, unsigned int index) {
+
+    unsigned int size = history_levels[level].size;
+
+    return &history->levels[level].buckets[(history->levels[level].head + size -
+        history->levels[level].count + index) % size];
+}
+
+// Start a new bucket, overwriting the oldest when full
+struct bucket *history_append(struct history *history, int level) {
+
+    struct bucket *bucket = &history->levels[level].buckets[history->levels[level].head];
+
+    history->levels[level].head = (history->levels[level].head + 1) % history_levels[level].size;
+    if (history->levels[level].count < history_levels[level].size) history->levels[level].count++;
+
+    memset(bucket, 0, sizeof(*bucket));
+
+    return bucket;
+}
+
+// Add a measurement to each level of the history
+void history_add(struct meter *meter, struct sample *sample) {
+
+    struct history *history = meter->history;
+    struct bucket *bucket;
+    gint64 time = (gint64)sample->time.tv_sec * G_USEC_PER_SEC + sample->time.tv_usec;
+    float value = sample->measurement * scale_factor[sample->scale & 0x07];
+
+    if (!history) {
+        history = meter->history = g_new0(struct history, 1);
+        for (int level = 0; level < HISTORY_LEVELS; level++) {
+            history->levels[level].buckets = g_new(struct bucket, history_levels[level].size);
+        }
+    }
+
+    bucket = history_append(history, 0);
+    bucket->start = time;
+    bucket->min = bucket->max = bucket->sum = value;
+    bucket->count = 1;
+    bucket->function = sample->function;
+    bucket->scale = sample->scale;
+    bucket->decimal = sample->decimal;
+    bucket->type = sample->type;
+
+    // Overloads have no value to summarise
+    if (sample->decimal > 3) return;
+
+    for (int level = 1; level < HISTORY_LEVELS; level++) {
+        gint64 start = time - time % history_levels[level].period;
+
+        // The newest bucket is updated in place until its period ends or the function changes
+        bucket = history->levels[level].count ?
+            history_bucket(history, level, history->levels[level].count - 1) : NULL;
+
+        if (!bucket || (bucket->start != start) || (bucket->function != sample->function)) {
+            bucket = history_append(history, level);
+            bucket->start = start;
+            bucket->min = bucket->max = value;
+            bucket->function = sample->function;
+        }
+
+        if (value < bucket->min) bucket->min = value;
+        if (value > bucket->max) bucket->max = value;
+        bucket->sum += value;
+        bucket->count++;
+        bucket->scale = sample->scale;
+        bucket->decimal = sample->decimal;
+    }
+}
+
+// Count the buckets in a level starting before a time
+unsigned int history_find(struct history *history, int level, gint64 time) {
+
+    unsigned int low = 0, high = history->levels[level].count;
+
+    while (low < high) {
+        unsigned int middle = (low + high) / 2;
+
+        if (history_bucket(history, level, middle)->start < time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// Format a bucket value at the scale of its latest measurement
+void history_format(GString *line, struct output_options *options, struct meter *meter,
+        struct bucket *bucket, float value, uint16_t type) {
+
+    struct sample sample;
+
+    strcpy(sample.device, meter->address);
+    sample.function = bucket->function;
+    sample.scale = bucket->scale;
+    sample.decimal = bucket->decimal;
+    sample.measurement = value / scale_factor[bucket->scale & 0x07];
+    sample.type = type;
+    sample.time.tv_sec = bucket->start / G_USEC_PER_SEC;
+    sample.time.tv_usec = bucket->start % G_USEC_PER_SEC;
+
+    format_reading(line, options, &sample);
+}
+
+// Output the line introducing a meter's history, in the requested output format
+void history_header(GString *line, struct output_options *options, struct meter *meter,
+        unsigned int period, unsigned int points) {
+
+    switch (options->format) {
+        case space:
+            g_string_append_printf(line, "history %s period %u points %u\n", meter->address, period, points);
+            break;
+
+        case csv:
+            g_string_append_printf(line, "# history %s period %u points %u\n", meter->address, period, points);
+            break;
+
+        case json:
+            g_string_append_printf(line, "{\"history\":\"%s\", \"period\":%u, \"points\":%u}\n",
+                meter->address, period, points);
+            break;
+    }
+}
+
+// Output the history of a meter between two times as at most the given number of points.
+// Uses the finest level that covers the time range within the number of points, so the work
+// done depends on the number of points rather than the length of the history.
+void history_query(GString *line, struct output_options *options, struct meter *meter,
+        gint64 from, gint64 to, unsigned int points) {
+
+    struct history *history = meter->history;
+    unsigned int first = 0, last = 0, group = 1;
+    int level, coarsest = 0;
+
+    if (!history) {
+        history_header(line, options, meter, 0, 0);
+        return;
+    }
+
+    for (level = 0; level < HISTORY_LEVELS; level++) {
+        if (!history->levels[level].count) continue;
+
+        coarsest = level;
+
+        // Include a bucket that started before the range but ends within it
+        first = history_find(history, level, from - (history_levels[level].period ?
+            history_levels[level].period - 1 : 0));
+        last = history_find(history, level, to + 1);
+
+        // Once a level is full, older measurements are only available from coarser levels
+        if ((level < HISTORY_LEVELS - 1) && (history->levels[level].count == history_levels[level].size) &&
+                (history_bucket(history, level, 0)->start > from)) {
+            continue;
+        }
+
+        if (last - first <= points) break;
+    }
+
+    // Even the coarsest level has too many buckets - combine them
+    if (level == HISTORY_LEVELS) {
+        level = coarsest;
+        first = history_find(history, level, from - (history_levels[level].period ?
+            history_levels[level].period - 1 : 0));
+        last = history_find(history, level, to + 1);
+        group = MAX((last - first + points - 1) / points, 1);
+    }
+
+    // Say how the points that follow were made - period 0 is one line per measurement, otherwise
+    // each point covers the period and is three lines, the low, high and mean
+    history_header(line, options, meter, history_levels[level].period * group / G_USEC_PER_SEC,
+        (last - first + group - 1) / group);
+
+    for (unsigned int index = first; index < last; index += group) {
+        struct bucket *bucket = history_bucket(history, level, index);
+        struct bucket merged = *bucket;
+
+        if (level == 0) {
+            history_format(line, options, meter, bucket, bucket->min, bucket->type);
+            continue;
+        }
+
+        for (unsigned int i = index + 1; (i < index + group) && (i < last); i++) {
+            bucket = history_bucket(history, level, i);
+
+            if (bucket->min < merged.min) merged.min = bucket->min;
+            if (bucket->max > merged.max) merged.max = bucket->max;
+            merged.sum += bucket->sum;
+            merged.count += bucket->count;
+            merged.scale = bucket->scale;
+            merged.decimal = bucket->decimal;
+        }
+
+        history_format(line, options, meter, &merged, merged.min, 0x100);
+        history_format(line, options, meter, &merged, merged.max, 0x200);
+        history_format(line, options, meter, &merged, merged.sum / merged.count, 0x400);
+    }
+}
+
+// Outputs the measurement
+void display_reading(struct meter *meter, uint16_t* reading) {
+
+    struct sample sample;
+
+    strcpy(sample.device, meter->address);
+
+    // Extract data items from first number
+    sample.function = (reading[0] >> 6) & 0x0f;
+    sample.scale = (reading[0] >> 3) & 0x07;
+    sample.decimal = reading[0] & 0x07;
+    sample.type = reading[1];
+
+    // Extract and convert measurement value
+    if (reading[2] < 0x7fff) {
+        sample.measurement = (float)reading[2] / pow(10.0, sample.decimal);
+    } else {
+        sample.measurement = -1 * (float)(reading[2] & 0x7fff) / pow(10.0, sample.decimal);
+    }
+
+    // Timestamp the measurement
+    if (meter->offline_time) {
+        sample.time.tv_sec = meter->offline_time;
+        sample.time.tv_usec = 0;
+    } else {
+        gettimeofday(&sample.time, NULL);
+    }
+
+    // Check alarms first so actions are taken as quickly as possible
+    if (num_rules && !meter->downloading) rules_check(meter, &sample);
+
+    // History is kept to answer control socket queries
+    if (control_socket && !meter->downloading) history_add(meter, &sample);
+
+    last_sample = sample;
+    have_sample = TRUE;
+
+    if (clients) clients_publish(&sample);
+
+    if (dashboard) dashboard_update(meter->address, &sample);
+
+    // Check for low battery condition
+    if (reading[1] & 0x08) {
+        if (!meter->low_battery && !dashboard) {
+            if (num_meters > 1) {
+                fprintf(stderr, "LOW BATTERY %s\n", meter->address);
+            } else {
+                fprintf(stderr, "LOW BATTERY\n");
+            }
+        }
+
+        if (meter->low_battery++ > 17) meter->low_battery = 0;
+
+    } else {
+        meter->low_battery = FALSE;
+    }
+
+    sinks_publish(&sample);
+}
+
+
+// Check whether any meter is still downloading its offline recording
+_Bool downloads_pending() {
+
+    for (int i = 0; i < num_meters; i++) {
+        if (meters[i].downloading) return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Handler for BLE notification events
+void notification_handler(const uuid_t* uuid, const uint8_t* data, size_t data_length, void* user_data) {
+
+    struct meter *meter = user_data;
+    uint16_t reading[3];
+    int index;
+
+    meter->arrival = g_get_monotonic_time();
+
+    // Reset watchdog flag
+    meter->active = TRUE;
+
+    meter->packets++;
+    meter->adapter->packets++;
+
+    if (capture_file) capture_packet(meter, CAPTURE_RECEIVED, ATT_NOTIFICATION, uuid, data, data_length);
+
+    if (meter->downloading) {
+        // Process offline recording dump packet
+
+        if (!meter->offline_function && (data_length < 20)) return;
+
+        if (!meter->offline_function && (data[0] == 0xff)) return;  // skip lead-in
+
+        index = 0;
+
+        if (!meter->offline_function) {
+            // Read header
+
+            // Extract recording start timestamp
+            struct tm brokentime;
+
+            brokentime.tm_year = data[0] * 100 + data[1];
+            brokentime.tm_mon = data[2] - 1;
+            brokentime.tm_mday = data[3];
+            brokentime.tm_hour = data[4];
+            brokentime.tm_min = data[5];
+            brokentime.tm_sec = data[6];
+
+            meter->offline_time = mktime(&brokentime);
+
+            // Extract measurement interval
+            meter->offline_interval = *((uint32_t *)(data+8));
+
+            // Extract measurement function and units
+            meter->offline_function = *((uint16_t *)(data+16));
+
+            index = 18;
+
+        }
+
+        reading[0] = meter->offline_function;
+        reading[1] = 0;
+
+        for(;index < 20; index+=2) {
+
+            if (*((uint16_t *)(data+index)) == 0xffff) {
+                // Return to realtime measurements
+                meter->downloading = FALSE;
+                meter->offline_function = 0;
+                meter->offline_time = 0;
+
+                if (control_socket) {
+                    if (!quiet) fprintf(stderr, "Download complete %s\n", meter->address);
+                } else if (!downloads_pending()) {
+                    g_main_loop_quit(loop);
+                }
+                return;
+            }
+
+            reading[2] = *((uint16_t *)(data+index));
+
+            display_reading(meter, reading);
+
+            meter->offline_time += meter->offline_interval;
+        }
+
+    } else if ((data_length == 6) && (data[1] >= 0xf0)) {
+
+        // Realtime measurement packet
+
+        display_reading(meter, (uint16_t*)data);
+
+        if (!sample_timing) sample_timing = g_get_monotonic_time();
+
+        if (sample_count && (++samples == sample_count)) g_main_loop_quit(loop);
+
+    } else {
+
+        char line[3 * 64 + 1] = "";
+
+        if (data_length > 64) data_length = 64;
+
+        for (int i = 0; i < data_length; i++) {
+            sprintf(line + 3 * i, "%02x ", data[i]);
+        }
+
+        report_error("Unrecognized packet: %s", line);
+
+    }
+
+
+}
+
+// Offline conversion of previously captured output
+#define CONVERT_CHUNK       (4 * 1024 * 1024)   // Bytes of input per work unit
+#define CONVERT_LINE_LIMIT  256
+
+char *convert_input = NULL;
+unsigned int convert_threads = 0;
+
+struct chunk {
+    const char *start;
+    const char *end;
+    GString *output;
+    unsigned long errors;
+    _Bool done;
+};
+
+struct converter {
+    struct chunk *chunks;
+    int num_chunks;
+    int next;           // Next chunk to be converted
+    int written;        // Chunks written to output
+    int window;         // Maximum chunks converted ahead of output
+    struct output_options options;
+    time_t elapsed_base;
+    GMutex lock;
+    GCond cond;
+};
+
+// Per thread cache of the local time at the start of an hour
+struct hour_cache {
+    char key[14];
+    time_t start;
+};
+
+// Parse a measurement timestamp in any of the output formats
+enum output_timestamp parse_timestamp(const char *text, struct timeval *time, time_t elapsed_base,
+        struct hour_cache *cache) {
+
+    int minute, second, tenths = 0;
+    double value;
+    char *end;
+
+    if ((strlen(text) >= 19) && (text[4] == '-') && (text[10] == ' ')) {
+
+        // Date and time - mktime is only needed once per hour
+        if (strncmp(cache->key, text, 13) != 0) {
+            struct tm brokentime;
+
+            memset(&brokentime, 0, sizeof(brokentime));
+            if (sscanf(text, "%d-%d-%d %d", &brokentime.tm_year, &brokentime.tm_mon,
+                    &brokentime.tm_mday, &brokentime.tm_hour) != 4) return none;
+
+            brokentime.tm_year -= 1900;
+            brokentime.tm_mon -= 1;
+            brokentime.tm_isdst = -1;
+
+            cache->start = mktime(&brokentime);
+            strncpy(cache->key, text, 13);
+        }
+
+        if (sscanf(text + 14, "%d:%d.%d", &minute, &second, &tenths) < 2) return none;
+
+        time->tv_sec = cache->start + minute * 60 + second;
+        time->tv_usec = tenths * 100000;
+
+        return date;
+    }
+
+    value = g_ascii_strtod(text, &end);
+    if ((end == text) || (*end != '\0')) return none;
+
+    if (strchr(text, '.')) {
+        if (value >= 1e8) {
+            time->tv_sec = (time_t)value;
+            time->tv_usec = (value - time->tv_sec) * 1000000 + 0.5;
+            return actual_sec;
+        }
+
+        time->tv_sec = elapsed_base + (time_t)value;
+        time->tv_usec = (value - (time_t)value) * 1000000 + 0.5;
+        return elapsed_sec;
+    }
+
+    if (value >= 1e11) {
+        time->tv_sec = value / 1000;
+        time->tv_usec = fmod(value, 1000) * 1000;
+        return actual_milli;
+    }
+
+    time->tv_sec = elapsed_base + value / 1000;
+    time->tv_usec = fmod(value, 1000) * 1000;
+    return elapsed_milli;
+}
+
+// Parse a measurement value, keeping the number of decimal places displayed
+_Bool parse_measurement(const char *text, struct sample *sample) {
+
+    char *end;
+    const char *point;
+
+    if (strcmp(text, "Overload") == 0) {
+        sample->measurement = 0;
+        sample->decimal = 7;
+        return TRUE;
+    }
+
+    sample->measurement = g_ascii_strtod(text, &end);
+    if ((end == text) || (*end != '\0')) return FALSE;
+
+    point = strchr(text, '.');
+    sample->decimal = point ? strlen(point + 1) : 0;
+
+    return TRUE;
+}
+
+// Parse the measurement units into scale and function
+_Bool parse_units(const char *text, struct sample *sample) {
+
+    const int scales[] = {4, 1, 2, 3, 5, 6};
+
+    // Try without a prefix first so that units starting with a prefix letter match
+    for (int i = 0; i < G_N_ELEMENTS(scales); i++) {
+        int scale = scales[i];
+        size_t prefix = strlen(scale_prefix[scale]);
+
+        if (strncmp(text, scale_prefix[scale], prefix) != 0) continue;
+
+        for (int function = 0; function < 13; function++) {
+            if (strcmp(text + prefix, function_units[function]) == 0) {
+                sample->scale = scale;
+                sample->function = function;
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+// Parse the measurement type
+void parse_type(const char *text, struct sample *sample) {
+
+    sample->type = 0;
+
+    if (strstr(text, "Δ")) sample->type |= 0x02;
+    if (strstr(text, "min")) sample->type |= 0x10;
+    if (strstr(text, "max")) sample->type |= 0x20;
+    if (strstr(text, "hold")) sample->type |= 0x01;
+}
+
+// Extract a JSON value by key from a line of output
+_Bool parse_json_field(char *line, const char *key, char **value) {
+
+    char *start = strstr(line, key);
+    char *end;
+
+    if (!start) return FALSE;
+
+    start += strlen(key);
+    while (*start == ' ') start++;
+
+    if (*start == '"') {
+        end = strchr(++start, '"');
+    } else {
+        end = start + strcspn(start, ", }");
+    }
+
+    if (!end) return FALSE;
+
+    *end = '\0';
+    *value = start;
+
+    return TRUE;
+}
+
+// Check whether a field is a meter's bluetooth address
+_Bool is_address(const char *text) {
+
+    return (strlen(text) == 17) && (text[2] == ':') && (text[14] == ':');
+}
+
+// Parse a line of space separated, CSV or JSON output
+_Bool parse_reading(const char *text, size_t length, struct sample *sample, enum output_timestamp *stamp,
+        time_t elapsed_base, struct hour_cache *cache) {
+
+    char line[CONVERT_LINE_LIMIT];
+    char date_time[CONVERT_LINE_LIMIT];
+    char *field[8];
+    char *timestamp = NULL, *measurement = NULL, *unit = NULL, *type = NULL, *device = NULL;
+    int fields = 0;
+
+    if (length >= sizeof(line)) return FALSE;
+
+    memcpy(line, text, length);
+    line[length] = '\0';
+
+    if (line[0] == '{') {
+
+        // Keys are located before any values are terminated
+        char *timestamp_key = strstr(line, "\"timestamp\":");
+        char *measurement_key = strstr(line, "\"measurement\":");
+        char *units_key = strstr(line, "\"units\":");
+        char *type_key = strstr(line, "\"type\":");
+        char *device_key = strstr(line, "\"device\":");
+
+        if (device_key) parse_json_field(device_key, "\"device\":", &device);
+        if (timestamp_key) parse_json_field(timestamp_key, "\"timestamp\":", &timestamp);
+        if (measurement_key) parse_json_field(measurement_key, "\"measurement\":", &measurement);
+        if (units_key) parse_json_field(units_key, "\"units\":", &unit);
+        if (type_key) parse_json_field(type_key, "\"type\":", &type);
+
+    } else if (strchr(line, ',')) {
+
+        char *saveptr = line;
+
+        while ((fields < 8) && (field[fields] = strsep(&saveptr, ","))) {
+            field[fields] = g_strstrip(field[fields]);
+
+            // Meter address is only present when there are several meters
+            if ((fields == 0) && !device && is_address(field[0])) {
+                device = field[0];
+                continue;
+            }
+
+            fields++;
+        }
+
+        switch (fields) {
+            case 4:
+                type = field[3];
+                unit = field[2];
+                measurement = field[1];
+                timestamp = field[0];
+                break;
+
+            case 3:
+                type = field[2];
+                unit = field[1];
+                measurement = field[0];
+                break;
+
+            case 2:
+                measurement = field[1];
+                timestamp = field[0];
+                break;
+
+            default:
+                return FALSE;
+        }
+
+    } else {
+
+        char *saveptr;
+        int index = 0;
+
+        for (char *token = strtok_r(line, " \t\r", &saveptr); token && (fields < 8);
+                token = strtok_r(NULL, " \t\r", &saveptr)) {
+
+            if ((fields == 0) && !device && is_address(token)) {
+                device = token;
+                continue;
+            }
+
+            field[fields++] = token;
+        }
+
+        if (fields == 0) return FALSE;
+
+        if ((fields > 1) && (strlen(field[0]) == 10) && (field[0][4] == '-')) {
+            // Date and time are separate fields
+            snprintf(date_time, sizeof(date_time), "%s %s", field[0], field[1]);
+            timestamp = date_time;
+            index = 2;
+        } else if ((fields > 1) && isdigit((unsigned char)field[0][0]) &&
+                (isdigit((unsigned char)field[1][field[1][0] == '-']) || (strcmp(field[1], "Overload") == 0))) {
+            timestamp = field[0];
+            index = 1;
+        }
+
+        if (index < fields) measurement = field[index++];
+        if (index < fields) unit = field[index++];
+
+        // Type flags may have been separated by spaces
+        if (index < fields) {
+            type = field[index];
+            for (index++; index < fields; index++) field[index][-1] = ' ';
+        }
+    }
+
+    if (!measurement || !parse_measurement(measurement, sample)) return FALSE;
+
+    sample->device[0] = '\0';
+    if (device) strncat(sample->device, device, sizeof(sample->device) - 1);
+
+    // Values without units can only be reformatted, not rescaled
+    if (!unit || !parse_units(unit, sample)) {
+        sample->scale = 4;
+        sample->function = 13;
+    }
+
+    parse_type(type ? type : "", sample);
+
+    *stamp = none;
+    if (timestamp) *stamp = parse_timestamp(timestamp, &sample->time, elapsed_base, cache);
+
+    return TRUE;
+}
+
+// Convert one chunk of input lines
+void convert_chunk(struct converter *converter, struct chunk *chunk) {
+
+    struct output_options options = converter->options;
+    struct output_options unitless = converter->options;
+    struct hour_cache cache = {"", 0};
+    struct sample sample;
+    enum output_timestamp stamp;
+    const char *line = chunk->start;
+
+    chunk->output = g_string_sized_new((chunk->end - chunk->start) + (chunk->end - chunk->start) / 4);
+
+    // Values without units have no scale to convert from
+    unitless.units = 0;
+
+    while (line < chunk->end) {
+        const char *end = memchr(line, '\n', chunk->end - line);
+
+        if (!end) end = chunk->end;
+
+        if (!parse_reading(line, end - line, &sample, &stamp, converter->elapsed_base, &cache)) {
+            if (end > line) chunk->errors++;
+        } else if ((options.timestamp != none) && (stamp == none)) {
+            // Only the first line is checked up front - don't make up a time for the rest
+            chunk->errors++;
+        } else {
+            format_reading(chunk->output, (sample.function == 13) ? &unitless : &options, &sample);
+        }
+
+        line = end + 1;
+    }
+}
+
+// Conversion worker thread
+gpointer convert_worker(gpointer data) {
+
+    struct converter *converter = data;
+    int index;
+
+    g_mutex_lock(&converter->lock);
+
+    while (TRUE) {
+
+        // Limit memory use by staying within a window of the output
+        while ((converter->next < converter->num_chunks) &&
+                (converter->next >= converter->written + converter->window)) {
+            g_cond_wait(&converter->cond, &converter->lock);
+        }
+
+        if (converter->next >= converter->num_chunks) break;
+
+        index = converter->next++;
+
+        g_mutex_unlock(&converter->lock);
+
+        convert_chunk(converter, &converter->chunks[index]);
+
+        g_mutex_lock(&converter->lock);
+
+        converter->chunks[index].done = TRUE;
+        g_cond_broadcast(&converter->cond);
+    }
+
+    g_mutex_unlock(&converter->lock);
+
+    return NULL;
+}
+
+// Convert captured output to the selected output options
+int convert(const char *input) {
+
+    struct converter converter;
+    GThread **threads;
+    const char *data, *position, *end;
+    size_t size;
+    GString *buffer = NULL;
+    unsigned long errors = 0;
+    int fd = -1;
+
+    if (strcmp(input, "-") == 0) {
+
+        // Pipes can't be mapped so read into memory
+        char block[65536];
+        ssize_t length;
+
+        buffer = g_string_new(NULL);
+        while ((length = read(STDIN_FILENO, block, sizeof(block))) > 0) {
+            g_string_append_len(buffer, block, length);
+        }
+
+        data = buffer->str;
+        size = buffer->len;
+
+    } else {
+
+        struct stat info;
+
+        fd = open(input, O_RDONLY);
+        if ((fd < 0) || fstat(fd, &info)) {
+            fprintf(stderr, "ERROR: Failed to open %s.\n", input);
+            return 1;
+        }
+
+        size = info.st_size;
+        data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Failed to read %s.\n", input);
+            return 1;
+        }
+
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+
+    memset(&converter, 0, sizeof(converter));
+    converter.options = output;
+    converter.options.show_device = TRUE;
+    converter.elapsed_base = time(NULL);
+
+    // Check the first line can be converted to the requested timestamps
+    if (output.timestamp != none) {
+        struct hour_cache cache = {"", 0};
+        struct sample sample;
+        enum output_timestamp stamp;
+        const char *eol = memchr(data, '\n', size);
+
+        if (!parse_reading(data, (eol ? eol : data + size) - data, &sample, &stamp,
+                converter.elapsed_base, &cache) || (stamp == none)) {
+            fprintf(stderr, "ERROR: Input is not timestamped.\n");
+            return 1;
+        }
+
+        if (((stamp == elapsed_sec) || (stamp == elapsed_milli)) &&
+                (output.timestamp != elapsed_sec) && (output.timestamp != elapsed_milli)) {
+            fprintf(stderr, "ERROR: Elapsed timestamps can only be converted to elapsed timestamps.\n");
+            return 1;
+        }
+
+        // Elapsed time is measured from the first line, not the start of each chunk
+        converter.options.start_time = sample.time.tv_sec*1000 + sample.time.tv_usec/1000;
+    }
+
+    // Split input into chunks on line boundaries
+    converter.num_chunks = 0;
+    converter.chunks = g_new0(struct chunk, size / CONVERT_CHUNK + 1);
+
+    for (position = data; position < data + size; position = end) {
+        end = position + MIN(CONVERT_CHUNK, (size_t)(data + size - position));
+
+        if (end < data + size) {
+            const char *eol = memchr(end, '\n', data + size - end);
+            end = eol ? eol + 1 : data + size;
+        }
+
+        converter.chunks[converter.num_chunks].start = position;
+        converter.chunks[converter.num_chunks].end = end;
+        converter.num_chunks++;
+    }
+
+    if (!convert_threads) convert_threads = g_get_num_processors();
+
+    converter.window = convert_threads * 2;
+    g_mutex_init(&converter.lock);
+    g_cond_init(&converter.cond);
+
+    threads = g_new(GThread *, convert_threads);
+    for (int i = 0; i < convert_threads; i++) {
+        threads[i] = g_thread_new("convert", convert_worker, &converter);
+    }
+
+    // Write chunks out in order as they complete
+    for (int i = 0; i < converter.num_chunks; i++) {
+        struct chunk *chunk = &converter.chunks[i];
+
+        g_mutex_lock(&converter.lock);
+        while (!chunk->done) g_cond_wait(&converter.cond, &converter.lock);
+        g_mutex_unlock(&converter.lock);
+
+        fwrite(chunk->output->str, 1, chunk->output->len, stdout);
+        g_string_free(chunk->output, TRUE);
+        errors += chunk->errors;
+
+        g_mutex_lock(&converter.lock);
+        converter.written++;
+        g_cond_broadcast(&converter.cond);
+        g_mutex_unlock(&converter.lock);
+    }
+
+    for (int i = 0; i < convert_threads; i++) g_thread_join(threads[i]);
+
+    fflush(stdout);
+
+    if (errors && !quiet) fprintf(stderr, "Skipped %lu unrecognised lines.\n", errors);
+
+    g_free(threads);
+    g_free(converter.chunks);
+    if (buffer) g_string_free(buffer, TRUE);
+    if (fd >= 0) {
+        if (size) munmap((void *)data, size);
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void usage(char *argv[]) {
+    printf("%s [-i|-D] [-s|-S|-t|-T|-d] [-c|-j] [-n|-u|-m|-b|-k|-M] [-x] [-r] [-U <socket>] [-w <file>] [-q] [-h|-V]\n", argv[0]);
+    printf("\t[-A <rule>]... [-o [<options>:]<destination>]... [--rotate-size <bytes>] [--rotate-time <seconds>]\n");
+    printf("\t[--fsync <seconds>] [--compress]\n");
+    printf("\t[-a <adapter>]... [--meters <n>] [--hotplug] [--allow <device_address>]...\n");
+    printf("\t[--once|--count <n>] [--deadline <seconds>] [--timing]\n");
+    printf("\t[<device_address>[@<adapter>]]...\n");
+    printf("\tMeasurement collection\n\n");
+    printf("%s -R <seconds per measurement> <number of measurements> [<device_address>]\n", argv[0]);
+    printf("\tStart offline measurement recording\n\n");
+    printf("%s --convert <file> [--threads <n>] [-s|-S|-t|-T|-d] [-c|-j] [-n|-u|-m|-b|-k|-M] [-x]\n", argv[0]);
+    printf("\tConvert previously captured output to another format, scale or timestamp\n\n");
+    printf("\tClient for Owon B35/B35+/B35T+ digital multimeters using bluetooth.\n\n");
+    printf("\t-A <rule>\t Alarm rule checked against each measurement - repeat for several rules\n");
+    printf("\t\t\t  <units> > <limit> | < <limit> | outside <low> <high> | rate > <limit per second>\n");
+    printf("\t\t\t  [for <samples>] : log | fifo <path> | exec <command> | control <name> | exit <code>\n");
+    printf("\t-a <adapter>\t Use bluetooth adapter, eg. hci1 - repeat to spread meters across adapters\n");
+    printf("\t-i\t\t Interactive remote control\n");
+    printf("\t-D\t\t Interactive remote control with full screen dashboard\n");
+    printf("\t-s\t\t Timestamp measurements in elapsed seconds from first reading\n");
+    printf("\t-S\t\t Timestamp measurements in Unix epoch seconds\n");
+    printf("\t-t\t\t Timestamp measurements in elapsed milliseconds from first reading\n");
+    printf("\t-T\t\t Timestamp measurements in Javascript epoch milliseconds\n");
+    printf("\t-d\t\t Timestamp measurements with ISO date/time\n");
+    printf("\t-c\t\t Comma separated values (CSV) output\n");
+    printf("\t-j\t\t JSON output\n");
+    printf("\t-n\t\t Scale measurements to nano units\n");
+    printf("\t-u\t\t Scale measurements to micro units\n");
+    printf("\t-m\t\t Scale measurements to milli units\n");
+    printf("\t-b\t\t Scale measurements to base units\n");
+    printf("\t-k\t\t Scale measurements to kilo units\n");
+    printf("\t-M\t\t Scale measurements to mega units\n");
+    printf("\t-x\t\t Output measurement value without units or type for use with feedgnuplot\n");
+    printf("\t-o <output>\t Write measurements to a file, FIFO or - for stdout, with its own output\n");
+    printf("\t\t\t  options, eg. cd:log.csv - repeat to write several outputs at once\n");
+    printf("\t-R\t\t Start offline measurement recording\n");
+    printf("\t-r\t\t Download offline measurement recording\n");
+    printf("\t-U <socket>\t Stay connected and accept commands on a Unix domain control socket\n");
+    printf("\t-w <file>\t Capture raw bluetooth packets to btsnoop file, or pcap if <file> ends in .pcap\n");
+    printf("\t-q\t\t Quiet - no status output\n");
+    printf("\t-h\t\t Display this help and exit\n");
+    printf("\t-V\t\t Display version and exit\n");
+    printf("\t--rotate-size <bytes> Start a new output file after <bytes>, with optional k, M or G suffix\n");
+    printf("\t--rotate-time <s> Start a new output file every <s> seconds\n");
+    printf("\t\t\t  output file names can include strftime time fields, eg. log-%%Y%%m%%d.csv\n");
+    printf("\t--fsync <s>\t Sync output files to disk every <s> seconds\n");
+    printf("\t--compress\t Compress output files with gzip once they are closed\n");
+    printf("\t--meters <n>\t Number of meters to use, scanning for any not given\n");
+    printf("\t--hotplug\t Keep scanning in the background to attach meters as they are switched on\n");
+    printf("\t--allow <addr>\t Only use meters with this address - repeat to allow several\n");
+    printf("\t--once\t\t Exit after the first measurement\n");
+    printf("\t--count <n>\t Exit after <n> measurements\n");
+    printf("\t--deadline <s>\t Exit if not complete within <s> seconds\n");
+    printf("\t\t\t  exit status is 2 if not found, 3 if connection failed, 4 if timed out\n");
+    printf("\t--timing\t Report time taken to scan, connect and receive the first measurement\n");
+    printf("\t--convert <file> Convert captured output read from <file> or - for stdin\n");
+    printf("\t--threads <n>\t Number of conversion threads, defaults to one per processor\n");
+    printf("\t<device_address> Address of Owon multimeter to connect, optionally @<adapter> to use\n");
+    printf("\t\t\t  otherwise will connect to first meter found if not specified\n");
+    printf("\n\tInteractive controls:\n");
+    printf("\t\ts - Select\n");
+    printf("\t\ta - Auto\n");
+    printf("\t\tr - Range\n");
+    printf("\t\tl - Backlight\n");
+    printf("\t\th - Hold\n");
+    printf("\t\tb - Turn off Bluetooth\n");
+    printf("\t\td - Delta (Relative)\n");
+    printf("\t\tf - Fequency Hz/Duty\n");
+    printf("\t\tm - Min/Max\n");
+    printf("\t\tn - Normal display\n");
+    printf("\t\tq - Quit (dashboard only)\n");
+
+}
+
+// Map an interactive control key to its control code
+uint16_t control_code(char key) {
+
+    switch (key) {
+        case 's':
+            return SELECT;
+
+        case 'a':
+            return AUTO;
+
+        case 'r':
+            return RANGE;
+
+        case 'l':
+            return LIGHT;
+
+        case 'h':
+            return HOLD;
+
+        case 'b':
+            return BLUETOOTH_OFF;
+
+        case 'd':
+            return RELATIVE;
+
+        case 'f':
+            return HZ;
+
+        case 'm':
+            return MIN_MAX;
+
+        case 'n':
+            return NORMAL;
+
+    }
+
+    return 0;
+}
+
+// Send a control code to the multimeter
+int send_control(struct meter *meter, uint16_t control) {
+
+    int ret = meter_write(meter, &g_control_uuid, &control, sizeof(control));
+
+    if (ret) {
+        report_error("Failed to send control.");
+    }
+
+    return ret;
+}
+
+// Event handler for interactive controls
+static gboolean interactive_read(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data) {
+
+    gchar buffer;
+    gsize chars_read;
+
+    uint16_t control;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		g_io_channel_unref(chan);
+		return FALSE;
+	}
+
+	g_io_channel_read_chars(chan, &buffer, 1, &chars_read, NULL);
+
+    if (dashboard && (buffer == 'q')) {
+        g_main_loop_quit(loop);
+        return TRUE;
+    }
+
+    control = control_code(buffer);
+
+    // Controls apply to all connected meters
+    for (int i = 0; control && (i < num_meters); i++) {
+        if (meters[i].connection) send_control(&meters[i], control);
+    }
+
+	return TRUE;
+}
+
+// Find an adapter by name, adding it if not already in use
+struct adapter *find_adapter(const char *name) {
+
+    for (int i = 0; i < num_adapters; i++) {
+        if ((adapters[i].name == name) ||
+                (adapters[i].name && name && (strcmp(adapters[i].name, name) == 0))) return &adapters[i];
+    }
+
+    if (num_adapters == MAX_ADAPTERS) {
+        fprintf(stderr, "ERROR: Too many adapters.\n");
+        exit(1);
+    }
+
+    adapters[num_adapters].name = name;
+
+    return &adapters[num_adapters++];
+}
+
+// Select the adapter with the fewest meters
+struct adapter *least_loaded_adapter() {
+
+    struct adapter *least = &adapters[0];
+
+    for (int i = 1; i < num_adapters; i++) {
+        if (adapters[i].meters < least->meters) least = &adapters[i];
+    }
+
+    return least;
+}
+
+// Find a meter by address
+struct meter *find_meter(const char *address) {
+
+    for (int i = 0; i < num_meters; i++) {
+        if (g_ascii_strcasecmp(meters[i].address, address) == 0) return &meters[i];
+    }
+
+    return NULL;
+}
+
+// Add a meter, assigning it to the least loaded adapter unless pinned to one
+struct meter *add_meter(const char *address, struct adapter *adapter) {
+
+    struct meter *meter;
+
+    if (num_meters == MAX_METERS) return NULL;
+
+    meter = &meters[num_meters++];
+    memset(meter, 0, sizeof(struct meter));
+
+    strncpy(meter->address, address, sizeof(meter->address) - 1);
+    meter->pinned = (adapter != NULL);
+    meter->adapter = adapter ? adapter : least_loaded_adapter();
+    meter->adapter->meters++;
+
+    return meter;
+}
+
+// Check whether a scanned meter is on the allow list
+_Bool meter_allowed(const char *address) {
+
+    if (num_allowed == 0) return TRUE;
+
+    for (int i = 0; i < num_allowed; i++) {
+        if (g_ascii_strcasecmp(allowed[i], address) == 0) return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Handler for new device discovery
+static void ble_discovered_device(const char* addr, const char* name) {
+
+    if ((name != NULL) && (strcmp(BDM, name) == 0) && (num_meters < wanted_meters) &&
+            !find_meter(addr) && meter_allowed(addr)) {
+
+        if (!quiet) fprintf(stderr, "Found %s\n", addr);
+
+        add_meter(addr, NULL);
+
+        // Don't wait for the scan timeout when sampling
+        if (sample_count && (num_meters == wanted_meters)) gattlib_adapter_scan_disable(adapter_handle);
+   }
+
+}
+
+// Scan each adapter in turn for meters
+int scan_adapters() {
+
+    int ret;
+
+    for (int i = 0; (i < num_adapters) && (num_meters < wanted_meters); i++) {
+
+        struct adapter *adapter = &adapters[i];
+
+        ret = gattlib_adapter_open(adapter->name, &adapter_handle);
+        if (ret) {
+            fprintf(stderr, "ERROR: Failed to open adapter %s.\n",
+                adapter->name ? adapter->name : "");
+            return ret;
+        }
+
+        ret = gattlib_adapter_scan_enable(adapter_handle, ble_discovered_device, BLE_SCAN_TIMEOUT);
+        if (ret) {
+            fprintf(stderr, "ERROR: Failed to scan.\n");
+            return ret;
+        }
+        gattlib_adapter_scan_disable(adapter_handle);
+
+        gattlib_adapter_close(adapter_handle);
+    }
+
+    return 0;
+}
+
+
+// Record the outcome of a connection attempt
+_Bool connect_result(struct meter *meter) {
+
+    if (meter->connection == NULL) {
+        if (!quiet) fprintf(stderr, "Fail to connect to the multimeter bluetooth device.\n");
+        meter->adapter->failures++;
+        dashboard_link(meter->address, link_timeout);
+        return FALSE;
+    }
+
+    meter->adapter->connects++;
+    dashboard_link(meter->address, link_connected);
+
+    return TRUE;
+}
+
+// Make one attempt to connect to a bluetooth multimeter, waiting for the result
+_Bool connect_attempt(struct meter *meter) {
+
+    if (!quiet) fprintf(stderr, "Connecting %s...\n", meter->address);
+    dashboard_link(meter->address, link_connecting);
+
+    meter->connection = gattlib_connect(meter->adapter->name, meter->address, BDADDR_LE_PUBLIC,
+        BT_SEC_LOW, 0, 0);
+
+    return connect_result(meter);
+}
+
+// Connect to bluetooth multimeter, retrying until connected
+void connect_device(struct meter *meter) {
+
+    int attempts = 0;
+
+    while (!connect_attempt(meter)) {
+        if (sample_count && !deadline && (++attempts == CONNECT_RETRIES)) exit(EXIT_CONNECT_FAILED);
+
+        sleep(1);
+    }
+}
+
+// Asynchronous connection attempt
+struct connect_request {
+    struct meter *meter;
+    unsigned int attempt;
+    gatt_connection_t *connection;
+};
+
+// Finish a connection attempt on the main loop
+gboolean connect_finish(gpointer data) {
+
+    struct connect_request *request = data;
+    struct meter *meter = request->meter;
+
+    if (!meter->connecting || (request->attempt != meter->attempt)) {
+        // Given up on already - don't leave the meter connected
+        if (request->connection) gattlib_disconnect(request->connection);
+    } else {
+        meter->connecting = FALSE;
+        meter->connection = request->connection;
+        connect_result(meter);
+        meter->connected(meter);
+    }
+
+    g_free(request);
+
+    return FALSE;
+}
+
+// gattlib's connection callback - may run on gattlib's own thread so hand the result to the main loop
+void connect_callback(gatt_connection_t *connection, void *data) {
+
+    struct connect_request *request = data;
+
+    request->connection = connection;
+    g_idle_add(connect_finish, request);
+}
+
+// Start connecting to a meter without waiting, calling connected from the main loop with the result
+void connect_start(struct meter *meter, void (*connected)(struct meter *meter)) {
+
+    struct connect_request *request = g_new0(struct connect_request, 1);
+
+    if (!quiet) fprintf(stderr, "Connecting %s...\n", meter->address);
+    dashboard_link(meter->address, link_connecting);
+
+    meter->connecting = TRUE;
+    meter->connect_started = g_get_monotonic_time();
+    meter->connected = connected;
+
+    request->meter = meter;
+    request->attempt = ++meter->attempt;
+
+    if (!gattlib_connect_async(meter->adapter->name, meter->address, BDADDR_LE_PUBLIC, BT_SEC_LOW,
+            0, 0, connect_callback, request)) {
+        g_idle_add(connect_finish, request);
+    }
+}
+
+// Give up on a connection attempt that has taken too long
+void connect_expire(struct meter *meter) {
+
+    if (g_get_monotonic_time() - meter->connect_started < CONNECT_TIMEOUT * G_USEC_PER_SEC) return;
+
+    meter->connecting = FALSE;
+    meter->connection = NULL;
+    connect_result(meter);
+    meter->connected(meter);
+}
+
+// Start the notification listener
+void start_listener(struct meter *meter) {
+    gattlib_register_notification(meter->connection, notification_handler, meter);
+
+    int ret = gattlib_notification_start(meter->connection, &g_measurement_uuid);
+    if (ret) {
+        report_error("Fail to start listener.");
+        exit(1);
+    }
+}
+
+// Start offline recording on the multimeter
+int start_recording(struct meter *meter, uint32_t interval, uint32_t num_measurements) {
+
+    int ret;
+
+    char *index;
+
+    uint8_t buffer[16];
+
+    struct tm *date;
+    time_t now;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    // Send current date/time
+    index = stpcpy((char *)buffer, DATE_CMD);
+
+    now = time(NULL);
+    date = localtime(&now);
+
+    index[0] = (uint8_t)(date->tm_year/100);
+    index[1] = (uint8_t)(date->tm_year - date->tm_year/100);
+    index[2] = (uint8_t)(date->tm_mon + 1);
+    index[3] = (uint8_t)(date->tm_mday);
+    index[4] = (uint8_t)(date->tm_hour);
+    index[5] = (uint8_t)(date->tm_min);
+    index[6] = (uint8_t)(date->tm_sec);
+
+    ret = meter_write(meter, &g_command_uuid, buffer, sizeof(buffer));
+    if (ret) {
+        report_error("Fail to write date.");
+        return ret;
+    }
+
+    //  Send recording parameters
+    memset(buffer, 0, sizeof(buffer));
+
+    index = stpcpy((char *)buffer, RECORD_CMD);
+
+    ((uint32_t *)index)[0] = interval;
+    ((uint32_t *)index)[1] = num_measurements;
+    ret = meter_write(meter, &g_command_uuid, buffer, sizeof(buffer));
+    if (ret) {
+        report_error("Failed to write record command.");
+        return ret;
+    }
+
+    return 0;
+}
+
+// Request download of the offline recording
+int request_download(struct meter *meter) {
+
+    int ret;
+
+    uint8_t buffer[16];
+    size_t len;
+
+    meter->downloading = TRUE;
+    meter->offline_function = 0;
+    meter->offline_time = 0;
+
+    // Check number of measurements available
+    memset(buffer, 0, sizeof(buffer));
+
+    stpcpy((char *)buffer, READLEN_CMD);
+
+    ret = meter_write(meter, &g_command_uuid, buffer, sizeof(buffer));
+    if (ret) {
+        report_error("Fail to request length of offline recorded measurements.");
+        return ret;
+    }
+
+
+    len = sizeof(buffer);
+    ret = meter_read(meter, &g_command_uuid, buffer, &len);
+    if (ret) {
+        report_error("Failed to read length of offline recorded measurements.");
+        return ret;
+    }
+
+    if (*((uint32_t *)buffer) == 0) {
+        report_error("No offline recorded measurements available.");
+    } else {
+        if (!quiet) fprintf(stderr, "Downloading %u offline recorded measurements.\n",
+            (*((uint32_t *)buffer)-2)/2);
+    }
+
+    // Request measurement data
+    memset(buffer, 0, sizeof(buffer));
+
+    stpcpy((char *)buffer, READ_CMD);
+
+    ret = meter_write(meter, &g_command_uuid, buffer, sizeof(buffer));
+    if (ret) {
+        report_error("Failed to request offline recorded measurements.");
+        return ret;
+    }
+
+    return 0;
+}
+
+gboolean reconnect_timeout(gpointer data);
+
+// Start listening once reconnected, or back off before trying again
+void reconnect_connected(struct meter *meter) {
+
+    if (meter->connection) {
+        gattlib_register_notification(meter->connection, notification_handler, meter);
+
+        if (gattlib_notification_start(meter->connection, &g_measurement_uuid) == 0) {
+            meter->retry = 0;
+            meter->active = TRUE;
+            return;
+        }
+
+        report_error("Fail to start listener.");
+        gattlib_disconnect(meter->connection);
+        meter->connection = NULL;
+    }
+
+    meter->retry = MIN(MAX(meter->retry * 2, RECONNECT_MIN), RECONNECT_MAX);
+    meter->reconnect_source = g_timeout_add_seconds(meter->retry, reconnect_timeout, meter);
+}
+
+// Reconnect to a meter - each attempt runs in the background, with the time between attempts
+// backing off so an unreachable meter doesn't keep the adapter busy
+gboolean reconnect_timeout(gpointer data) {
+
+    struct meter *meter = data;
+
+    meter->reconnect_source = 0;
+
+    connect_start(meter, reconnect_connected);
+
+    return FALSE;
+}
+
+// Drop the connection to a meter that has stopped responding and start reconnecting
+void reconnect_device(struct meter *meter) {
+
+    if (meter->connection) gattlib_disconnect(meter->connection);
+    meter->connection = NULL;
+
+    meter->retry = RECONNECT_MIN;
+    meter->reconnect_source = g_timeout_add_seconds(meter->retry, reconnect_timeout, meter);
+}
+
+
+// Background hot-plug scanning
+#define HOTPLUG_PERIOD      30      // Seconds between background scans
+#define HOTPLUG_WINDOW      1       // Seconds spent scanning on each adapter
+#define HOTPLUG_STABLE      300     // Seconds attached before a meter is considered stable
+#define HOTPLUG_MAX_HOLD    600     // Longest wait before reattaching a flapping meter
+
+_Bool hotplug = FALSE;
+
+GThread *hotplug_thread = NULL;
+GMutex hotplug_lock;
+GCond hotplug_cond;
+_Bool hotplug_stopping = FALSE;
+GList *hotplug_found = NULL;        // Addresses seen by the current scan - under hotplug_lock
+
+// Start listening to a newly found meter once connected
+void hotplug_attach(struct meter *meter) {
+
+    gint64 now = g_get_monotonic_time();
+
+    meter->pending = FALSE;
+
+    if (!meter->connection) {
+        meter->adapter->meters--;
+        meter->hold = MIN(MAX(meter->hold * 2, HOTPLUG_PERIOD), HOTPLUG_MAX_HOLD);
+        meter->hold_until = now + meter->hold * G_USEC_PER_SEC;
+        return;
+    }
+
+    meter->attached_at = now;
+    meter->active = TRUE;
+
+    gattlib_register_notification(meter->connection, notification_handler, meter);
+
+    if (gattlib_notification_start(meter->connection, &g_measurement_uuid)) {
+        report_error("Fail to start listener.");
+    }
+
+    if (!quiet) fprintf(stderr, "Attached %s\n", meter->address);
+}
+
+// Stop listening to a meter that has gone away
+void hotplug_detach(struct meter *meter) {
+
+    gint64 now = g_get_monotonic_time();
+
+    gattlib_disconnect(meter->connection);
+    meter->connection = NULL;
+    meter->downloading = FALSE;
+    meter->adapter->meters--;
+
+    // Back off meters that keep dropping out to avoid reconnect storms
+    if (now - meter->attached_at < HOTPLUG_STABLE * G_USEC_PER_SEC) {
+        meter->hold = MIN(MAX(meter->hold * 2, HOTPLUG_PERIOD), HOTPLUG_MAX_HOLD);
+    } else {
+        meter->hold = HOTPLUG_PERIOD;
+    }
+
+    meter->hold_until = now + meter->hold * G_USEC_PER_SEC;
+
+    if (!quiet) fprintf(stderr, "Detached %s\n", meter->address);
+    dashboard_link(meter->address, link_detached);
+}
+
+// Start connecting to meters seen by the last scan
+gboolean hotplug_seen(gpointer data) {
+
+    GList *found = data;
+    gint64 now = g_get_monotonic_time();
+
+    for (GList *item = found; item; item = item->next) {
+        char *address = item->data;
+        struct meter *meter = find_meter(address);
+
+        if (!meter_allowed(address)) continue;
+
+        if (meter) {
+            if (meter->connection || meter->pending || (now < meter->hold_until)) continue;
+
+            if (!meter->pinned) meter->adapter = least_loaded_adapter();
+            meter->adapter->meters++;
+        } else {
+            if (!(meter = add_meter(address, NULL))) continue;
+        }
+
+        meter->pending = TRUE;
+
+        if (!quiet) fprintf(stderr, "Found %s\n", address);
+
+        connect_start(meter, hotplug_attach);
+    }
+
+    g_list_free_full(found, g_free);
+
+    return FALSE;
+}
+
+// Handler for device discovery during background scans - depending on the gattlib backend this
+// can be called on either thread
+static void hotplug_discovered(const char* addr, const char* name) {
+
+    if ((name == NULL) || (strcmp(BDM, name) != 0)) return;
+
+    g_mutex_lock(&hotplug_lock);
+
+    for (GList *item = hotplug_found; item; item = item->next) {
+        if (g_ascii_strcasecmp(item->data, addr) == 0) {
+            g_mutex_unlock(&hotplug_lock);
+            return;
+        }
+    }
+
+    hotplug_found = g_list_prepend(hotplug_found, g_strdup(addr));
+
+    g_mutex_unlock(&hotplug_lock);
+}
+
+// Background scan thread - scanning blocks for the scan window so it is kept off the main loop.
+// Only adapter handles opened here are used on this thread, meters are connected and their
+// connections used only from the main loop.
+gpointer hotplug_scan(gpointer data) {
+
+    void *handle;
+    GList *found;
+
+    g_mutex_lock(&hotplug_lock);
+
+    for (int next = 0; !hotplug_stopping; next = (next + 1) % num_adapters) {
+        g_mutex_unlock(&hotplug_lock);
+
+        if (gattlib_adapter_open(adapters[next].name, &handle) == 0) {
+            gattlib_adapter_scan_enable(handle, hotplug_discovered, HOTPLUG_WINDOW);
+            gattlib_adapter_scan_disable(handle);
+            gattlib_adapter_close(handle);
+        }
+
+        g_mutex_lock(&hotplug_lock);
+
+        found = hotplug_found;
+        hotplug_found = NULL;
+        if (found) g_idle_add(hotplug_seen, found);
+
+        // Take each adapter in turn so every one is scanned once a period
+        gint64 next_scan = g_get_monotonic_time() + MAX(HOTPLUG_PERIOD / num_adapters, 1) * G_USEC_PER_SEC;
+
+        while (!hotplug_stopping && g_cond_wait_until(&hotplug_cond, &hotplug_lock, next_scan));
+    }
+
+    g_mutex_unlock(&hotplug_lock);
+
+    return NULL;
+}
+
+// Start background scanning
+void hotplug_start() {
+
+    g_mutex_init(&hotplug_lock);
+    g_cond_init(&hotplug_cond);
+    hotplug_thread = g_thread_new("hotplug", hotplug_scan, NULL);
+}
+
+// Stop background scanning
+void hotplug_end() {
+
+    g_mutex_lock(&hotplug_lock);
+    hotplug_stopping = TRUE;
+    g_cond_signal(&hotplug_cond);
+    g_mutex_unlock(&hotplug_lock);
+
+    g_thread_join(hotplug_thread);
+}
+
+// Connection watchdog
+
+guint timeout_sec = 5;
+
+gboolean watchdog_check(gpointer data) {
+
+    for (int i = 0; i < num_meters; i++) {
+        struct meter *meter = &meters[i];
+
+        if (!meter->connection) {
+            if (meter->connecting) connect_expire(meter);
+            continue;
+        }
+
+        if (!meter->active) {
+            if (!quiet) fprintf(stderr, "Timeout %s\n", meter->address);
+
+            if (hotplug) {
+                // Leave it to the background scan to find it again
+                hotplug_detach(meter);
+                continue;
+            }
+
+            dashboard_link(meter->address, link_timeout);
+
+            reconnect_device(meter);
+        }
+
+        meter->active = FALSE;
+    }
+
+    return TRUE;
+}
+
+// Report connection and packet statistics for each adapter
+void print_adapter_stats() {
+
+    double elapsed = (g_get_monotonic_time() - start_timing) / (double)G_USEC_PER_SEC;
+
+    for (int i = 0; i < num_adapters; i++) {
+        struct adapter *adapter = &adapters[i];
+
+        fprintf(stderr, "%s: %d meters, %lu connects, %lu failures, %lu packets, %.2f packets/s\n",
+            adapter->name ? adapter->name : "default", adapter->meters, adapter->connects,
+            adapter->failures, adapter->packets, elapsed > 0 ? adapter->packets / elapsed : 0.0);
+    }
+}
+
+gboolean adapter_stats_signal(gpointer data) {
+
+    print_adapter_stats();
+
+    return TRUE;
+}
+
+// Close a client connection
+void client_close(struct client *client) {
+
+    clients = g_list_remove(clients, client);
+
+    g_source_remove(client->input_watch);
+    sink_free(&client->sink);
+
+    g_string_free(client->input, TRUE);
+    g_free(client);
+}
+
+// Send a command response to a client
+void client_reply(struct client *client, const char *format, ...) {
+
+    va_list args;
+    gchar *text;
+
+    va_start(args, format);
+    text = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    // Replies are never dropped, only streamed measurements
+    sink_queue(&client->sink, text, strlen(text));
+    sink_queue(&client->sink, "\n", 1);
+
+    g_free(text);
+}
+
+// Select the meters a command applies to - all connected meters unless an address is given
+_Bool client_meters(struct client *client, const char *address, int *first, int *last) {
+
+    struct meter *meter;
+
+    *first = 0;
+    *last = num_meters;
+
+    if (address == NULL) {
+        // Don't report success for a command that reached no meters
+        for (int i = 0; i < num_meters; i++) {
+            if (meters[i].connection) return TRUE;
+        }
+
+        client_reply(client, "ERROR No meter connected");
+        return FALSE;
+    }
+
+    if (!(meter = find_meter(address))) {
+        client_reply(client, "ERROR Unknown meter %s", address);
+        return FALSE;
+    }
+
+    if (!meter->connection) {
+        client_reply(client, "ERROR Meter %s is not connected", address);
+        return FALSE;
+    }
+
+    *first = meter - meters;
+    *last = *first + 1;
+
+    return TRUE;
+}
+
+// Execute a command from a client - returns FALSE to close the connection
+_Bool client_command(struct client *client, char *command) {
+
+    char *saveptr;
+    char *verb = strtok_r(command, " \t\r", &saveptr);
+    char *arg;
+    int first, last;
+    int failed = 0;
+
+    if (verb == NULL) return TRUE;
+
+    if (g_ascii_strcasecmp(verb, "subscribe") == 0) {
+
+        struct output_options options = {space, none, 0, TRUE, output.show_device, 0};
+
+        // Options use the same letters as the command line
+        while ((arg = strtok_r(NULL, " \t\r", &saveptr))) {
+            for (char *option = (arg[0] == '-') ? arg + 1 : arg; *option; option++) {
+                if (!set_output_option(&options, *option)) {
+                    client_reply(client, "ERROR Unknown output option %c", *option);
+                    return TRUE;
+                }
+            }
+        }
+
+        client->sink.options = options;
+        client->subscribed = TRUE;
+        client_reply(client, "OK");
+
+    } else if (g_ascii_strcasecmp(verb, "unsubscribe") == 0) {
+
+        client->subscribed = FALSE;
+        client_reply(client, "OK");
+
+    } else if (g_ascii_strcasecmp(verb, "control") == 0) {
+
+        uint16_t control = 0;
+
+        if ((arg = strtok_r(NULL, " \t\r", &saveptr))) {
+            if (arg[1] == '\0') control = control_code(arg[0]);
+
+            for (int i = 0; !control && (i < G_N_ELEMENTS(control_names)); i++) {
+                if (g_ascii_strcasecmp(arg, control_names[i].name) == 0) control = control_names[i].control;
+            }
+        }
+
+        if (!control) {
+            client_reply(client, "ERROR Unknown control");
+        } else if (!client_meters(client, strtok_r(NULL, " \t\r", &saveptr), &first, &last)) {
+            return TRUE;
+        } else {
+            for (int i = first; i < last; i++) {
+                if (meters[i].connection) failed |= send_control(&meters[i], control);
+            }
+
+            client_reply(client, failed ? "ERROR Failed to send control" : "OK");
+        }
+
+    } else if (g_ascii_strcasecmp(verb, "record") == 0) {
+
+        char *count = NULL;
+        unsigned long seconds = 0, measurements = 0;
+
+        if ((arg = strtok_r(NULL, " \t\r", &saveptr)) && (count = strtok_r(NULL, " \t\r", &saveptr))) {
+            seconds = strtoul(arg, NULL, 0);
+            measurements = strtoul(count, NULL, 0);
+        }
+
+        if ((seconds < 1) || (measurements < 1) || (measurements > MAX_MEASUREMENTS)) {
+            client_reply(client, "ERROR Usage: record <seconds per measurement> <1-%d measurements>",
+                MAX_MEASUREMENTS);
+        } else if (!client_meters(client, strtok_r(NULL, " \t\r", &saveptr), &first, &last)) {
+            return TRUE;
+        } else {
+            for (int i = first; i < last; i++) {
+                if (meters[i].connection) failed |= start_recording(&meters[i], seconds, measurements);
+            }
+
+            client_reply(client, failed ? "ERROR Failed to start recording" : "OK");
+        }
+
+    } else if (g_ascii_strcasecmp(verb, "download") == 0) {
+
+        if (!client_meters(client, strtok_r(NULL, " \t\r", &saveptr), &first, &last)) return TRUE;
+
+        for (int i = first; i < last; i++) {
+            if (meters[i].downloading) {
+                client_reply(client, "ERROR Download already in progress");
+                return TRUE;
+            }
+        }
+
+        for (int i = first; i < last; i++) {
+            if (!meters[i].connection) continue;
+
+            if (request_download(&meters[i])) {
+                meters[i].downloading = FALSE;
+                failed = 1;
+            }
+        }
+
+        client_reply(client, failed ? "ERROR Failed to request download" : "OK");
+
+    } else if (g_ascii_strcasecmp(verb, "history") == 0) {
+
+        struct output_options options = client->sink.options;
+        struct meter *meter = NULL;
+        GString *line;
+        char *from_arg = strtok_r(NULL, " \t\r", &saveptr);
+        char *to_arg = strtok_r(NULL, " \t\r", &saveptr);
+        char *points_arg = strtok_r(NULL, " \t\r", &saveptr);
+        gint64 now = g_get_real_time();
+        gint64 from, to;
+        unsigned long points;
+
+        if (!points_arg) {
+            client_reply(client, "ERROR Usage: history <from> <to> <points> [<options>] [<address>]");
+            return TRUE;
+        }
+
+        // Times are Unix epoch seconds, or seconds relative to now if zero or negative
+        from = strtod(from_arg, NULL) * G_USEC_PER_SEC;
+        to = strtod(to_arg, NULL) * G_USEC_PER_SEC;
+        if (from <= 0) from += now;
+        if (to <= 0) to += now;
+
+        points = strtoul(points_arg, NULL, 0);
+        if ((points < 1) || (points > HISTORY_POINTS_MAX) || (from > to)) {
+            client_reply(client, "ERROR Invalid time range or number of points");
+            return TRUE;
+        }
+
+        options.start_time = 0;
+
+        while ((arg = strtok_r(NULL, " \t\r", &saveptr))) {
+            if (is_address(arg)) {
+                if (!(meter = find_meter(arg))) {
+                    client_reply(client, "ERROR Unknown meter %s", arg);
+                    return TRUE;
+                }
+                continue;
+            }
+
+            for (char *option = (arg[0] == '-') ? arg + 1 : arg; *option; option++) {
+                if (!set_output_option(&options, *option)) {
+                    client_reply(client, "ERROR Unknown output option %c", *option);
+                    return TRUE;
+                }
+            }
+        }
+
+        line = g_string_new(NULL);
+
+        for (int i = 0; i < num_meters; i++) {
+            if (meter && (meter != &meters[i])) continue;
+
+            history_query(line, &options, &meters[i], from, to, points);
+        }
+
+        // Queued in full as the reply can be much larger than the measurement buffer
+        sink_queue(&client->sink, line->str, line->len);
+        g_string_free(line, TRUE);
+
+        client_reply(client, "OK");
+
+    } else if (g_ascii_strcasecmp(verb, "status") == 0) {
+
+        GString *line = g_string_new(NULL);
+
+        for (int i = 0; i < num_meters; i++) {
+            client_reply(client, "meter %s adapter %s link %s mode %s packets %lu", meters[i].address,
+                meters[i].adapter->name ? meters[i].adapter->name : "default",
+                !meters[i].connection ? "detached" : meters[i].active ? "active" : "idle",
+                meters[i].downloading ? "download" : "realtime",
+                meters[i].packets);
+        }
+
+        for (int i = 0; i < num_adapters; i++) {
+            client_reply(client, "adapter %s meters %d connects %lu failures %lu packets %lu",
+                adapters[i].name ? adapters[i].name : "default", adapters[i].meters,
+                adapters[i].connects, adapters[i].failures, adapters[i].packets);
+        }
+
+        for (int i = 0; i < num_sinks; i++) {
+            g_mutex_lock(&sinks[i].lock);
+            g_string_printf(line, "output %s bytes %lu queued %u dropped %lu", sinks[i].destination,
+                sinks[i].written, (unsigned)sinks[i].buffer->len, sinks[i].dropped);
+            g_mutex_unlock(&sinks[i].lock);
+
+            if (sinks[i].log) log_stats(&sinks[i], line);
+
+            client_reply(client, "%s", line->str);
         }
+
+        g_string_truncate(line, 0);
+
+        for (int i = 0; i < num_rules; i++) {
+            client_reply(client, "alarm %s fired %lu", rules[i].text, rules[i].fired);
+        }
+
+        client_reply(client, "clients %u", g_list_length(clients));
+        client_reply(client, "dropped %lu", client->sink.dropped);
+
+        if (have_sample) {
+            struct output_options options = client->sink.options;
+
+            g_string_append(line, "last ");
+            format_reading(line, &options, &last_sample);
+            sink_queue(&client->sink, line->str, line->len);
+        }
+
+        g_string_free(line, TRUE);
+
+        client_reply(client, "OK");
+
+    } else if (g_ascii_strcasecmp(verb, "quit") == 0) {
+
+        client_reply(client, "OK");
+        return FALSE;
+
     } else {
+        client_reply(client, "ERROR Unknown command %s", verb);
+    }
 
-        for (int argi = 1; argi < argc; argi++) {
-            if (argv[argi][0] == '-') {
-                switch (argv[argi][1]) {
-                    case 's':
-                        timestamp = elapsed_sec;
-                        break;
+    return TRUE;
+}
 
-                    case 'S':
-                        timestamp = actual_sec;
-                        break;
+// Event handler for client commands
+gboolean client_read(GIOChannel *chan, GIOCondition cond, gpointer user_data) {
 
-                    case 't':
-                        timestamp = elapsed_milli;
-                        break;
+    struct client *client = user_data;
+    char buffer[512];
+    char *end;
+    ssize_t received;
 
-                    case 'T':
-                        timestamp = actual_milli;
-                        break;
+    received = recv(client->sink.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
 
-                    case 'd':
-                        timestamp = date;
-                        break;
+    if (received < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return TRUE;
+    }
 
-                    case 'c':
-                        format = csv;
-                        break;
+    if (received <= 0) {
+        client_close(client);
+        return FALSE;
+    }
 
-                    case 'j':
-                        format = json;
-                        break;
+    g_string_append_len(client->input, buffer, received);
 
-                    case 'n':
-                        units = 1;
-                        break;
+    while ((end = memchr(client->input->str, '\n', client->input->len))) {
+        *end = '\0';
 
-                    case 'u':
-                        units = 2;
-                        break;
+        if (!client_command(client, client->input->str)) {
+            // Deliver the final reply before closing
+            sink_flush(&client->sink);
+            client_close(client);
+            return FALSE;
+        }
 
-                    case 'm':
-                        units = 3;
-                        break;
+        g_string_erase(client->input, 0, end - client->input->str + 1);
+    }
 
-                    case 'b':
-                        units = 4;
-                        break;
+    if (client->input->len > CLIENT_LINE_LIMIT) {
+        client_close(client);
+        return FALSE;
+    }
 
-                    case 'k':
-                        units = 5;
-                        break;
+    return TRUE;
+}
 
-                    case 'M':
-                        units = 6;
-                        break;
+// Event handler for new client connections
+gboolean control_accept(GIOChannel *chan, GIOCondition cond, gpointer user_data) {
 
-                    case 'x':
-                        show_units = FALSE;
-                        break;
+    struct client *client;
+    int fd = accept(control_fd, NULL, NULL);
+
+    if (fd < 0) return TRUE;
+
+    client = g_new0(struct client, 1);
+    client->input = g_string_new(NULL);
+
+    sink_init(&client->sink, fd);
+    client->sink.destination = control_socket;
+    client->sink.socket = TRUE;
+    client->sink.options = (struct output_options){space, none, 0, TRUE, output.show_device, 0};
+
+    client->input_watch = g_io_add_watch(client->sink.channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+        client_read, client);
+
+    clients = g_list_prepend(clients, client);
+
+    return TRUE;
+}
+
+// Start listening on the control socket
+int control_start() {
+
+    struct sockaddr_un addr;
+    struct stat info;
+    GIOChannel *chan;
+
+    if (strlen(control_socket) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: Control socket path too long.\n");
+        return 1;
+    }
+
+    // Remove a stale socket left by a previous instance
+    if ((lstat(control_socket, &info) == 0) && S_ISSOCK(info.st_mode)) unlink(control_socket);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_socket);
+
+    if ((control_fd < 0) || bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            listen(control_fd, 16)) {
+        fprintf(stderr, "ERROR: Failed to open control socket %s.\n", control_socket);
+        return 1;
+    }
+
+    chan = g_io_channel_unix_new(control_fd);
+    g_io_add_watch(chan, G_IO_IN, control_accept, NULL);
+
+    if (!quiet) fprintf(stderr, "Listening on %s\n", control_socket);
+
+    return 0;
+}
+
+// Close the control socket and all client connections
+void control_stop() {
+
+    while (clients) client_close(clients->data);
+
+    close(control_fd);
+    unlink(control_socket);
+}
+
+#define DEADLINE_GRACE      2       // Seconds allowed for a clean exit after the deadline
+
+volatile sig_atomic_t loop_running = FALSE;
+
+// Exit status showing how far sampling got before the deadline
+int deadline_status() {
+
+    if (num_meters == 0) return EXIT_NOT_FOUND;
+
+    for (int i = 0; i < num_meters; i++) {
+        if (meters[i].connection == NULL) return EXIT_CONNECT_FAILED;
+    }
+
+    return EXIT_TIMEOUT;
+}
+
+// Deadline reached in the main loop - stop so output is flushed and timing reported
+gboolean deadline_timeout(gpointer data) {
+
+    if (!quiet) fprintf(stderr, "Deadline expired\n");
+
+    exit_status = deadline_status();
+    g_main_loop_quit(loop);
+
+    return FALSE;
+}
+
+// SIGALRM handler for the sampling deadline - exits straight away when blocked scanning or
+// connecting, otherwise leaves the main loop to stop cleanly unless it is stuck
+void deadline_handler(int signal) {
+
+    if (loop_running) {
+        loop_running = FALSE;
+        alarm(DEADLINE_GRACE);
+        return;
+    }
+
+    if (!quiet && (write(STDERR_FILENO, "Deadline expired\n", 17) < 0)) _exit(EXIT_TIMEOUT);
+
+    _exit(deadline_status());
+}
+
+// Report time taken to reach each startup stage
+void print_timing() {
+
+    fprintf(stderr, "Timing (ms): scan %.1f, connect %.1f, listener %.1f, first sample %.1f\n",
+        scan_timing ? (scan_timing - start_timing) / 1000.0 : 0.0,
+        connect_timing ? (connect_timing - start_timing) / 1000.0 : 0.0,
+        listen_timing ? (listen_timing - start_timing) / 1000.0 : 0.0,
+        sample_timing ? (sample_timing - start_timing) / 1000.0 : 0.0);
+}
+
+// SIGINT handler for clean shutdown
+void signal_handler(int signal){
+
+    g_main_loop_quit(loop);
+}
+
+// SIGTERM handler - services are stopped with SIGTERM, and log files still need their last
+// write, sync and stats
+gboolean terminate_signal(gpointer data) {
+
+    g_main_loop_quit(loop);
+
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    GIOChannel *pchan;
+
+    _Bool scan = TRUE;
+    gint64 deadline_at = 0;
+
+    char **addresses = g_new0(char *, argc);
+    int num_addresses = 0;
+
+    start_timing = g_get_monotonic_time();
+
+    if ((argc > 3) && (argv[1][0] == '-') && (argv[1][1] == 'R')) {
+
+        // Offline recording
+        interval = strtoul(argv[2], NULL, 0);
+        if (interval < 1) {
+            fprintf(stderr, "Measurement interval must be 1 or more seconds.\n");
+            return 1;
+        }
+
+
+        num_measurements = strtoul(argv[3], NULL, 0);
+        if ((num_measurements < 1) || (num_measurements > MAX_MEASUREMENTS)) {
+            fprintf(stderr, "Number of measurements must be between 0 and %d.\n", MAX_MEASUREMENTS);
+            return 1;
+        }
+
+        if (argc == 5) {
+            addresses[num_addresses++] = argv[4];
+            scan = FALSE;
+        }
+    } else {
+
+        for (int argi = 1; argi < argc; argi++) {
+            if ((argv[argi][0] == '-') && (argv[argi][1] == '-')) {
+
+                if (strcmp(argv[argi], "--once") == 0) {
+                    sample_count = 1;
+                } else if ((strcmp(argv[argi], "--count") == 0) && (argi + 1 < argc)) {
+                    sample_count = strtoul(argv[++argi], NULL, 0);
+                    if (sample_count < 1) {
+                        fprintf(stderr, "Number of measurements must be 1 or more.\n");
+                        return 1;
+                    }
+                } else if ((strcmp(argv[argi], "--deadline") == 0) && (argi + 1 < argc)) {
+                    deadline = strtoul(argv[++argi], NULL, 0);
+                } else if (strcmp(argv[argi], "--timing") == 0) {
+                    timing = TRUE;
+                } else if ((strcmp(argv[argi], "--convert") == 0) && (argi + 1 < argc)) {
+                    convert_input = argv[++argi];
+                } else if ((strcmp(argv[argi], "--threads") == 0) && (argi + 1 < argc)) {
+                    convert_threads = strtoul(argv[++argi], NULL, 0);
+                } else if ((strcmp(argv[argi], "--rotate-size") == 0) && (argi + 1 < argc)) {
+                    char *size = argv[++argi];
+                    char *suffix;
+
+                    rotate_size = strtoull(size, &suffix, 0);
+                    switch (*suffix) {
+                        case 'G': case 'g': rotate_size *= 1024;
+                        case 'M': case 'm': rotate_size *= 1024;
+                        case 'K': case 'k': rotate_size *= 1024;
+                            suffix++;
+                    }
+
+                    if (!isdigit((unsigned char)size[0]) || *suffix) {
+                        fprintf(stderr, "Invalid size %s, use bytes with an optional k, M or G suffix.\n", size);
+                        return 1;
+                    }
+                } else if ((strcmp(argv[argi], "--rotate-time") == 0) && (argi + 1 < argc)) {
+                    rotate_time = strtoul(argv[++argi], NULL, 0);
+                } else if ((strcmp(argv[argi], "--fsync") == 0) && (argi + 1 < argc)) {
+                    fsync_interval = strtoul(argv[++argi], NULL, 0);
+                } else if (strcmp(argv[argi], "--compress") == 0) {
+                    compress_logs = TRUE;
+                } else if (strcmp(argv[argi], "--hotplug") == 0) {
+                    hotplug = TRUE;
+                } else if ((strcmp(argv[argi], "--allow") == 0) && (argi + 1 < argc)) {
+                    allowed = g_renew(char *, allowed, num_allowed + 1);
+                    allowed[num_allowed++] = argv[++argi];
+                } else if ((strcmp(argv[argi], "--meters") == 0) && (argi + 1 < argc)) {
+                    wanted_meters = strtoul(argv[++argi], NULL, 0);
+                    if ((wanted_meters < 1) || (wanted_meters > MAX_METERS)) {
+                        fprintf(stderr, "Number of meters must be between 1 and %d.\n", MAX_METERS);
+                        return 1;
+                    }
+                } else {
+                    fprintf(stderr, "Unknown option %s\n\n", argv[argi]);
+                    usage(argv);
+                    return 1;
+                }
 
+            } else if (argv[argi][0] == '-') {
+                switch (argv[argi][1]) {
                     case 'r':
                         offline = TRUE;
                         break;
@@ -731,162 +4359,210 @@ int main(int argc, char *argv[]) {
                         interactive = TRUE;
                         break;
 
+                    case 'D':
+                        dashboard = TRUE;
+                        interactive = TRUE;
+                        break;
+
                     case 'V':
                         printf("%s version ", argv[0]);
                         printf(VERSION);
                         printf("\n");
                         return 0;
 
+                    case 'a':
+                        if (++argi == argc) {
+                            fprintf(stderr, "Missing adapter name\n\n");
+                            usage(argv);
+                            return 1;
+                        }
+                        find_adapter(argv[argi]);
+                        break;
+
+                    case 'U':
+                        if (++argi == argc) {
+                            fprintf(stderr, "Missing control socket path\n\n");
+                            usage(argv);
+                            return 1;
+                        }
+                        control_socket = argv[argi];
+                        break;
+
+                    case 'o':
+                        if (++argi == argc) {
+                            fprintf(stderr, "Missing output\n\n");
+                            usage(argv);
+                            return 1;
+                        }
+                        if (!add_sink(argv[argi])) return 1;
+                        break;
+
+                    case 'A':
+                        if (++argi == argc) {
+                            fprintf(stderr, "Missing alarm rule\n\n");
+                            usage(argv);
+                            return 1;
+                        }
+                        if (!add_rule(argv[argi])) return 1;
+                        break;
+
+                    case 'w':
+                        if (++argi == argc) {
+                            fprintf(stderr, "Missing capture file\n\n");
+                            usage(argv);
+                            return 1;
+                        }
+                        capture_file = argv[argi];
+                        break;
+
                     default:
+                        if (set_output_option(&output, argv[argi][1])) break;
+
                         fprintf(stderr, "Unknown option %s\n\n", argv[argi]);
                         usage(argv);
                         return 1;
 
                 }
             } else {
-                address = argv[argi];
-                scan = FALSE;
+                addresses[num_addresses++] = argv[argi];
             }
         }
     }
 
+    if (convert_input) return convert(convert_input);
+
+    // Without any outputs given, measurements go to stdout using the command line output options
+    if (num_sinks == 0) {
+        sinks[num_sinks].destination = "-";
+        sinks[num_sinks++].options = output;
+    }
+
+    if (sinks_open()) return 1;
+
+    if (deadline) {
+        signal(SIGALRM, deadline_handler);
+        alarm(deadline);
+        deadline_at = g_get_monotonic_time() + deadline * G_USEC_PER_SEC;
+    }
+
+    if (dashboard) dashboard_start();
+
+    if (capture_file && capture_start()) return 1;
+
+    // Use the default adapter unless others are specified
+    if (num_adapters == 0) find_adapter(NULL);
+
+    // Meters can be pinned to an adapter with <device_address>@<adapter>
+    for (int i = 0; i < num_addresses; i++) {
+        char *pin = strchr(addresses[i], '@');
+
+        if (pin) *pin++ = '\0';
+
+        if (!find_meter(addresses[i]) && !add_meter(addresses[i], pin ? find_adapter(pin) : NULL)) {
+            fprintf(stderr, "Too many meters, limit is %d.\n", MAX_METERS);
+            return 1;
+        }
+    }
+
+    g_free(addresses);
+
+    // Given addresses count towards --meters and only the rest are scanned for
+    if (num_meters >= wanted_meters) scan = FALSE;
+
     if (scan) {
 
         do {
             if (!quiet) fprintf(stderr, "Scanning...\n");
+            dashboard_set_status("Scanning...");
 
-            ret = gattlib_adapter_open(adapter_name, &adapter);
-            if (ret) {
-                fprintf(stderr, "ERROR: Failed to open adapter.\n");
-                return 1;
-            }
-
-            ret = gattlib_adapter_scan_enable(adapter, ble_discovered_device, BLE_SCAN_TIMEOUT);
-            if (ret) {
-                fprintf(stderr, "ERROR: Failed to scan.\n");
-                return 1;
-            }
-            gattlib_adapter_scan_disable(adapter);
+            if (scan_adapters()) return 1;
 
-            gattlib_adapter_close(adapter);
+            // Meters that appear later are picked up by the background scan
+            if (hotplug) break;
 
-            if (address == NULL) {
+            if (num_meters < wanted_meters) {
                 if (!quiet) fprintf(stderr, "Multimeter device not found.\n");
+                if (sample_count && !deadline) {
+                    if (num_meters == 0) return EXIT_NOT_FOUND;
+                    break;
+                }
+                dashboard_set_status("Multimeter device not found");
                 sleep(2);
             }
 
-        } while (address == NULL);
+        } while (num_meters < wanted_meters);
 
+        scan_timing = g_get_monotonic_time();
     }
 
-    if (address == NULL) {
+    if ((num_meters == 0) && !hotplug) {
         usage(argv);
         return 1;
     }
 
-    connect_device();
-
-    if (interval) {
-
-        // Start offline recording
-
-        char *index;
-
-        uint8_t buffer[16];
-
-        struct tm *date;
-        time_t now;
-
-        memset(buffer, 0, sizeof(buffer));
+    // Identify measurements when there are several meters
+    output.show_device = (num_meters > 1) || hotplug;
 
-        // Send current date/time
-        index = stpcpy((char *)buffer, DATE_CMD);
+    for (int i = 0; i < num_sinks; i++) sinks[i].options.show_device = output.show_device;
 
-        now = time(NULL);
-        date = localtime(&now);
+    dashboard_set_status("");
 
-        index[0] = (uint8_t)(date->tm_year/100);
-        index[1] = (uint8_t)(date->tm_year - date->tm_year/100);
-        index[2] = (uint8_t)(date->tm_mon + 1);
-        index[3] = (uint8_t)(date->tm_mday);
-        index[4] = (uint8_t)(date->tm_hour);
-        index[5] = (uint8_t)(date->tm_min);
-        index[6] = (uint8_t)(date->tm_sec);
-
-		ret = gattlib_write_char_by_uuid(connection, &g_command_uuid, buffer, sizeof(buffer));
-        if (ret) {
-            fprintf(stderr, "Fail to write date.\n");
-            return 1;
+    for (int i = 0; i < num_meters; i++) {
+        if (interval || offline || sample_count) {
+            connect_device(&meters[i]);
+        } else if (!connect_attempt(&meters[i])) {
+            // Keep going with the meters that are reachable, retrying the others in the background
+            reconnect_device(&meters[i]);
         }
+    }
 
-        //  Send recording parameters
-        memset(buffer, 0, sizeof(buffer));
+    connect_timing = g_get_monotonic_time();
 
-        index = stpcpy((char *)buffer, RECORD_CMD);
+    if (interval) {
 
-        ((uint32_t *)index)[0] = interval;
-        ((uint32_t *)index)[1] = num_measurements;
-		ret = gattlib_write_char_by_uuid(connection, &g_command_uuid, buffer, sizeof(buffer));
-        if (ret) {
-            fprintf(stderr, "Failed to write record command.\n");
-            return 1;
+        // Start offline recording
+        for (int i = 0; i < num_meters; i++) {
+            if (start_recording(&meters[i], interval, num_measurements)) return 1;
         }
 
         if (!quiet) fprintf(stderr, "Recording started\n");
 
     } else {
 
-        start_listener();
-
-        if (offline) {
-            // Request offline recording download
-            uint8_t buffer[16];
-            size_t len;
+        loop = g_main_loop_new(NULL, 0);
 
-            // Check number of measurements available
-            memset(buffer, 0, sizeof(buffer));
+        for (int i = 0; i < num_meters; i++) {
+            if (meters[i].connection) start_listener(&meters[i]);
+        }
 
-            stpcpy((char *)buffer, READLEN_CMD);
+        listen_timing = g_get_monotonic_time();
 
-            ret = gattlib_write_char_by_uuid(connection, &g_command_uuid, buffer, sizeof(buffer));
-            if (ret) {
-                fprintf(stderr, "Fail to request length of offline recorded measurements.\n");
-                return 1;
+        if (offline) {
+            // Request offline recording download
+            for (int i = 0; i < num_meters; i++) {
+                if (request_download(&meters[i])) return 1;
             }
+        }
 
+        g_unix_signal_add(SIGUSR1, adapter_stats_signal, NULL);
+        g_unix_signal_add(SIGHUP, log_reopen_signal, NULL);
 
-            len = sizeof(buffer);
-            ret = gattlib_read_char_by_uuid(connection, &g_command_uuid, buffer, &len);
-            if (ret) {
-                fprintf(stderr, "Failed to read length of offline recorded measurements.\n");
-                return 1;
-            }
+        if (hotplug) hotplug_start();
 
-            if (*((uint32_t *)buffer) == 0) {
-                fprintf(stderr, "No offline recorded measurements available.\n");
-            } else {
-                if (!quiet) fprintf(stderr, "Downloading %u offline recorded measurements.\n",
-                    (*((uint32_t *)buffer)-2)/2);
-            }
+        // The deadline replaces the watchdog when sampling
+        if (!(sample_count && deadline)) g_timeout_add_seconds(timeout_sec, watchdog_check, NULL);
 
-            // Request measurement data
-            memset(buffer, 0, sizeof(buffer));
+        signal(SIGINT, signal_handler);
 
-            stpcpy((char *)buffer, READ_CMD);
+        if (control_socket && control_start()) return 1;
 
-            ret = gattlib_write_char_by_uuid(connection, &g_command_uuid, buffer, sizeof(buffer));
-            if (ret) {
-                fprintf(stderr, "Failed to request offline recorded measurements.\n");
-                return 1;
+        for (int i = 0; i < num_sinks; i++) {
+            if (control_socket || sinks[i].log) {
+                g_unix_signal_add(SIGTERM, terminate_signal, NULL);
+                break;
             }
         }
 
-        g_timeout_add_seconds(timeout_sec, watchdog_check, NULL);
-
-        loop = g_main_loop_new(NULL, 0);
-
-        signal(SIGINT, signal_handler);
-
         if (interactive) {
 
             // Disable terminal buffering
@@ -905,16 +4581,40 @@ int main(int argc, char *argv[]) {
             g_io_add_watch(pchan, events, interactive_read, NULL);
         }
 
+        // Only stop through the main loop once it exists - until now SIGALRM enforces the deadline
+        if (deadline) {
+            g_timeout_add(MAX(deadline_at - g_get_monotonic_time(), 0) / 1000, deadline_timeout, NULL);
+        }
+
+        loop_running = TRUE;
         g_main_loop_run(loop);
+        loop_running = FALSE;
+
+        // Cleaning up doesn't count against the deadline
+        if (deadline) alarm(0);
+
+        if (hotplug) hotplug_end();
 
         g_main_loop_unref(loop);
+
+        if (control_socket) control_stop();
     }
 
-    gattlib_disconnect(connection);
+    if (timing) print_timing();
+
+    if (!quiet && ((num_adapters > 1) || (num_meters > 1))) print_adapter_stats();
+
+    if (!quiet) print_rule_stats();
+
+    sinks_close();
+
+    for (int i = 0; i < num_meters; i++) {
+        if (meters[i].connection) gattlib_disconnect(meters[i].connection);
+    }
     if (!quiet) fprintf(stderr,"Disconnected\n");
 
     if (interactive)
         tcsetattr(0, TCSANOW, &orig_termios);
 
-    return 0;
+    return exit_status;
 }